@@ -29,6 +29,8 @@ void CCall::accept(Visitor * v)            { v->visit(this); }
 void EvalCall::accept(Visitor * v)         { v->visit(this); }
 void TypeCall::accept(Visitor * v)         { v->visit(this); }
 void LengthCall::accept(Visitor * v)       { v->visit(this); }
+void GcCall::accept(Visitor * v)           { v->visit(this); }
+void GcStatsCall::accept(Visitor * v)      { v->visit(this); }
 void Index::accept(Visitor * v)            { v->visit(this); }
 void Assignment::accept(Visitor * v)       { v->visit(this); }
 void SimpleAssignment::accept(Visitor * v) { v->visit(this); }
@@ -117,6 +117,16 @@ class TypeCall : public SpecialCall {
         TypeCall(ast::Exp * arg) { args.push_back(arg); }
         void accept(Visitor * v) override;
     };
+/** Call to gc().  */
+class GcCall : public SpecialCall {
+    public:
+        void accept(Visitor * v) override;
+    };
+/** Call to gcstats().  */
+class GcStatsCall : public SpecialCall {
+    public:
+        void accept(Visitor * v) override;
+    };
 /** Indexed read.  */
 class Index : public Exp {
     public:
@@ -203,6 +213,8 @@ public:
     virtual void visit(ast::EvalCall * n)         { visit(static_cast<ast::SpecialCall*>(n)); }
     virtual void visit(ast::TypeCall * n)         { visit(static_cast<ast::SpecialCall*>(n)); }
     virtual void visit(ast::LengthCall * n)       { visit(static_cast<ast::SpecialCall*>(n)); }
+    virtual void visit(ast::GcCall * n)           { visit(static_cast<ast::SpecialCall*>(n)); }
+    virtual void visit(ast::GcStatsCall * n)      { visit(static_cast<ast::SpecialCall*>(n)); }
     virtual void visit(ast::Index * n)            { visit(static_cast<ast::Exp*>(n)); }
     virtual void visit(ast::Assignment * n)       { visit(static_cast<ast::Exp*>(n)); }
     virtual void visit(ast::SimpleAssignment * n) { visit(static_cast<ast::Assignment*>(n)); }
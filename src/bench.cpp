@@ -0,0 +1,165 @@
+#include <chrono>
+#include <iomanip>
+#include <thread>
+
+#include "runtime.h"
+#include "bench.h"
+
+using namespace std;
+using namespace rift;
+
+namespace {
+
+/** Builds the live objects: a chain of environments, each holding a full
+    set of bindings pointing at scalars. */
+Environment * buildLiveSet(unsigned objects) {
+    gc::HandleScope scope;
+    gc::Handle<Environment> env(Environment::New(nullptr));
+    for (unsigned i = 0; i < objects; ++i) {
+        if (i % 64 == 0)
+            env = Environment::New(env);
+        RVal * value = DoubleVector::New({static_cast<double>(i)});
+        env->set(i % 64, value);
+    }
+    return env;
+}
+
+/** Allocates a mix of short lived objects typical for Rift code: mostly
+    scalars, some environments and small bindings and strings. */
+void __attribute__((noinline)) churn(unsigned count) {
+    for (unsigned i = 0; i < count; ++i) {
+        switch (i % 8) {
+            case 0:
+                Environment::New(nullptr);
+                break;
+            case 1:
+                Bindings::New(2);
+                break;
+            case 2:
+                CharacterVector::New("benchmark");
+                break;
+            case 3:
+                DoubleVector::New(i % 16);
+                break;
+            default:
+                DoubleVector::New({static_cast<double>(i)});
+        }
+    }
+}
+
+/** Scalar heavy Rift code. Every literal and every arithmetic result is a
+    fresh double vector of length one, so these mostly measure how fast
+    compiled code allocates. */
+struct ScalarProgram {
+    char const * name;
+    char const * source;
+};
+
+/** Recurses depth levels deep, every level keeping a vector across the
+    call, and allocates at the bottom. Each minor gc only rescans the
+    frames which changed since the previous one, so its pause should not
+    depend on the depth. */
+string deepProgram(unsigned depth) {
+    return "f = function(n) { a = c(n) if (n == 0) { i = 0 "
+        "while (i < 200000) { x = c(i) i = i + 1 } 0 } "
+        "else { f(n - 1) + a[0] } } f(" + to_string(depth) + ")";
+}
+
+ScalarProgram const scalarPrograms[] = {
+    {"fib(22)", "fib = function(n) { if (n < 2) { 1 } else { fib(n - 2) + fib(n - 1) } } fib(22)"},
+    {"loop", "s = 0 i = 0 while (i < 200000) { s = s + i * 2 i = i + 1 } s"},
+};
+
+}
+
+namespace rift {
+
+    /** Measures allocation throughput while an increasing amount of live
+        data is kept on the heap, the time of a full gc with an increasing
+        number of marking threads, minor gc pauses under a deepening stack
+        and the run time of scalar code. */
+    void benchmarks() {
+        constexpr unsigned allocations = 2000000;
+        // The first row would otherwise also pay for growing the heap from
+        // nothing.
+        churn(allocations);
+        cout << "Allocation throughput" << endl;
+        cout << setw(12) << "live objs" << setw(16) << "Mallocs/s" << endl;
+        for (unsigned live = 1000; live <= 256000; live *= 4) {
+            gc::HandleScope scope;
+            gc::Handle<Environment> root(buildLiveSet(live));
+            auto start = chrono::high_resolution_clock::now();
+            churn(allocations);
+            auto t = chrono::high_resolution_clock::now() - start;
+            double secs = static_cast<double>(t.count()) /
+                chrono::high_resolution_clock::period::den;
+            cout << setw(12) << live
+                 << setw(16) << allocations / secs / 1e6 << endl;
+        }
+        auto const & minor = gc::GarbageCollector::minorPauses();
+        auto const & major = gc::GarbageCollector::majorPauses();
+        cout << endl << setw(12) << "pauses" << setw(10) << "count"
+             << setw(14) << "avg ms" << setw(14) << "max ms" << endl;
+        cout << setw(12) << "minor" << setw(10) << minor.count
+             << setw(14) << minor.average() * 1e3
+             << setw(14) << minor.max * 1e3 << endl;
+        cout << setw(12) << "major" << setw(10) << major.count
+             << setw(14) << major.average() * 1e3
+             << setw(14) << major.max * 1e3 << endl;
+
+        constexpr unsigned gcLive = 1 << 20;
+        constexpr unsigned gcRounds = 5;
+        unsigned cores = thread::hardware_concurrency();
+        gc::HandleScope scope;
+        gc::Handle<Environment> root(buildLiveSet(gcLive));
+        cout << endl << "Full gc with " << gcLive << " live objs" << endl;
+        cout << setw(12) << "threads" << setw(16) << "ms/gc" << endl;
+        for (unsigned threads = 1; threads == 1 || threads <= cores;
+                threads *= 2) {
+            gc::GarbageCollector::setMarkThreads(threads);
+            auto start = chrono::high_resolution_clock::now();
+            for (unsigned i = 0; i < gcRounds; ++i)
+                gc::GarbageCollector::collect();
+            chrono::duration<double> t =
+                chrono::high_resolution_clock::now() - start;
+            cout << setw(12) << threads
+                 << setw(16) << t.count() / gcRounds * 1e3 << endl;
+        }
+        gc::GarbageCollector::setMarkThreads(cores ? cores : 1);
+
+        cout << endl << "Minor gc pauses at the bottom of a recursion"
+             << endl;
+        cout << setw(12) << "depth" << setw(10) << "count" << setw(14)
+             << "avg ms" << endl;
+        for (unsigned depth = 1; depth <= 1000; depth *= 10) {
+            gc::HandleScope scope;
+            Globals globals;
+            gc::Handle<Environment> env(Environment::NewGlobal(&globals));
+            size_t count = minor.count;
+            double total = minor.total;
+            eval(env, deepProgram(depth).c_str());
+            count = minor.count - count;
+            total = minor.total - total;
+            cout << setw(12) << depth << setw(10) << count << setw(14)
+                 << (count ? total / count * 1e3 : 0) << endl;
+        }
+
+        constexpr unsigned scalarRounds = 5;
+        cout << endl << "Scalar code" << endl;
+        cout << setw(12) << "program" << setw(16) << "ms/run" << endl;
+        for (auto const & program : scalarPrograms) {
+            gc::HandleScope scope;
+            Globals globals;
+            gc::Handle<Environment> env(Environment::NewGlobal(&globals));
+            eval(env, program.source);
+            auto start = chrono::high_resolution_clock::now();
+            for (unsigned i = 0; i < scalarRounds; ++i)
+                eval(env, program.source);
+            chrono::duration<double> t =
+                chrono::high_resolution_clock::now() - start;
+            cout << setw(12) << program.name
+                 << setw(16) << t.count() / scalarRounds * 1e3 << endl;
+        }
+    }
+
+} // namespace rift
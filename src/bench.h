@@ -0,0 +1,7 @@
+#pragma once
+
+namespace rift {
+
+    void benchmarks();
+
+} // namespace rift
@@ -1,5 +1,6 @@
 #include "rift.h"
 #include "compiler.h"
+#include "layout.h"
 #include "pool.h"
 
 using namespace llvm;
@@ -104,15 +105,29 @@ Compiler::FunctionContext::FunctionContext(string name, Module* m) {
     // Rift ABI specifies the initial environment as only argument.
     // All function args are bound in there.
     Function::arg_iterator args = f->arg_begin();
-    env = &*args;
-    env->setName("env");
+    Value * arg = &*args;
+    arg->setName("env");
+    // The environment and all values live across runtime calls are kept
+    // in a frame on the GC's shadow stack, those are the precise roots of
+    // the function. The number of slots is patched in by compile().
+    enterFrame = b->CreateCall(gcEnterFrame(m), vector<Value*>({
+            ConstantInt::get(context(), APInt(32, 1))}), "frame");
+    frame = enterFrame;
+    env = b->CreateConstGEP1_32(frame, 0);
+    b->CreateStore(b->CreateBitCast(arg, type::ptrValue), env, true);
+    slots = 1;
 }
 
 int Compiler::compile(ast::Fun * n) {
+    // Functions get slots for their variables, the outermost code does
+    // not create its environment
+    unique_ptr<Layout> layout(scopes.empty() ? nullptr : new Layout(n));
+    scopes.push_back(layout.get());
     // Backup context in case we are creating a nested function
     FunctionContext oldContext(cur);
     // Create a new function context
     cur = FunctionContext("riftFunction", m.get());
+    safepoint();
     // if the function is empty, return 0 as default return value
     if (n->body->body.empty()) {
         result = RUNTIME_CALL(doubleVectorLiteral, fromDouble(0));
@@ -122,16 +137,150 @@ int Compiler::compile(ast::Fun * n) {
         n->body->accept(this);
         assert(result);
     }
-    // Append return instruction of the last used value
+    // Pop the frame and append return instruction of the last used value
+    RUNTIME_CALL(gcLeaveFrame, cur.frame);
     cur.b->CreateRet(result);
+    cur.enterFrame->setArgOperand(0, fromInt(cur.slots));
     // Register and get index
-    int idx = Pool::addFunction(n, cur.f);
+    int idx = Pool::addFunction(n, cur.f,
+            layout ? layout->symbols : vector<Symbol>());
     cur.f->setName(STR(idx));
     // Restore context
     cur.restore(oldContext);
+    scopes.pop_back();
     return idx;
 }
 
+Value * Compiler::protect(Value * value) {
+    Value * slot = cur.b->CreateConstGEP1_32(cur.frame, cur.slots++);
+    cur.b->CreateStore(value, slot, true);
+    return slot;
+}
+
+/** The loads and stores are volatile so that they are not folded across
+    calls. Runtime functions are declared pure, but the GC may move objects
+    while they run.  */
+Value * Compiler::reload(Value * slot) {
+    return cur.b->CreateLoad(slot, true);
+}
+
+Value * Compiler::env() {
+    return cur.b->CreateBitCast(reload(cur.env), type::ptrEnvironment);
+}
+
+/** Outer functions are searched until one assigns to the variable. Their
+    environments are always the parents, closures are created in them. A
+    function calling eval may have other variables too.  */
+bool Compiler::resolve(Symbol symbol, unsigned & depth, unsigned & slot) {
+    for (depth = 0; depth < scopes.size(); ++depth) {
+        Layout * l = scopes[scopes.size() - 1 - depth];
+        if (l == nullptr)
+            return false;
+        int i = l->slotOf(symbol);
+        if (i != -1) {
+            slot = i;
+            return true;
+        }
+        if (l->usesEval)
+            return false;
+    }
+    return false;
+}
+
+int Compiler::localSlot(Symbol symbol) {
+    Layout * l = scopes.back();
+    return l ? l->slotOf(symbol) : -1;
+}
+
+/** References in the environment are 32 bit offsets from the base of the
+    heap region, odd ones are immediates, see gc::HeapRef. The loads are
+    volatile like reload(), a collection updates them.  */
+Value * Compiler::loadSlot(unsigned depth, unsigned slot, Symbol symbol) {
+    static_assert(sizeof(gc::HeapRef<RVal>) == sizeof(int32_t), "");
+    static_assert(sizeof(Environment) == sizeof(RVal) +
+            2 * sizeof(gc::HeapRef<RVal>) + sizeof(unsigned) +
+            sizeof(Globals *), "");
+    unsigned parentOffset = sizeof(RVal);
+    unsigned valueOffset = sizeof(Environment) +
+        slot * Environment::ELEMENT_SIZE + sizeof(Symbol);
+    auto load32 = [this] (Value * address) {
+        return cur.b->CreateLoad(cur.b->CreateIntToPtr(address, type::ptrInt),
+                true);
+    };
+    Value * base = cur.b->CreateLoad(cur.b->CreateIntToPtr(
+            ConstantInt::get(type::Word,
+                reinterpret_cast<uintptr_t>(&gc::HeapRegion::base)),
+            type::ptrWord));
+    Value * e = cur.b->CreatePtrToInt(env(), type::Word);
+    for (unsigned i = 0; i < depth; ++i) {
+        Value * parent = load32(cur.b->CreateAdd(e,
+                    ConstantInt::get(type::Word, parentOffset)));
+        e = cur.b->CreateAdd(base, cur.b->CreateZExt(parent, type::Word));
+    }
+    Value * ref = load32(cur.b->CreateAdd(e,
+                ConstantInt::get(type::Word, valueOffset)));
+
+    BasicBlock * bound = BasicBlock::Create(
+            context(), "slotBound", cur.f, nullptr);
+    BasicBlock * unbound = BasicBlock::Create(
+            context(), "slotUnbound", cur.f, nullptr);
+    BasicBlock * merge = BasicBlock::Create(
+            context(), "slotLoaded", cur.f, nullptr);
+    cur.b->CreateCondBr(cur.b->CreateICmpNE(ref, fromInt(0)), bound, unbound);
+    // decode the reference
+    cur.b->SetInsertPoint(bound);
+    Value * immediate = cur.b->CreateTrunc(ref, type::Bool);
+    Value * value = cur.b->CreateIntToPtr(cur.b->CreateSelect(immediate,
+                cur.b->CreateSExt(ref, type::Word),
+                cur.b->CreateAdd(base, cur.b->CreateZExt(ref, type::Word))),
+            type::ptrValue);
+    cur.b->CreateBr(merge);
+    // not assigned yet, the variable is one of an outer environment
+    cur.b->SetInsertPoint(unbound);
+    Value * found = RUNTIME_CALL(envGet, env(), fromInt(symbol));
+    cur.b->CreateBr(merge);
+    cur.b->SetInsertPoint(merge);
+    PHINode * phi = cur.b->CreatePHI(type::ptrValue, 2, "var");
+    phi->addIncoming(value, bound);
+    phi->addIncoming(found, unbound);
+    return phi;
+}
+
+Value * Compiler::newCache() {
+    return ConstantExpr::getIntToPtr(ConstantInt::get(type::Word,
+                reinterpret_cast<uintptr_t>(Pool::addCache())),
+            type::ptrCharacter);
+}
+
+/** The flag is read with a plain volatile load, which is an acquire on
+    the platforms the JIT targets. The runtime is only called when a
+    collection waits.  */
+void Compiler::safepoint() {
+    static_assert(sizeof(atomic<bool>) == sizeof(char), "");
+    Value * requested = cur.b->CreateLoad(cur.b->CreateIntToPtr(
+            ConstantInt::get(type::Word, reinterpret_cast<uintptr_t>(
+                    gc::GarbageCollector::safepointRequested())),
+            type::ptrCharacter), true);
+    BasicBlock * stop = BasicBlock::Create(
+            context(), "safepoint", cur.f, nullptr);
+    BasicBlock * cont = BasicBlock::Create(
+            context(), "safepointDone", cur.f, nullptr);
+    cur.b->CreateCondBr(cur.b->CreateICmpNE(requested,
+                ConstantInt::get(type::Character, 0)), stop, cont);
+    cur.b->SetInsertPoint(stop);
+    RUNTIME_CALL(gcSafepoint);
+    cur.b->CreateBr(cont);
+    cur.b->SetInsertPoint(cont);
+}
+
+void Compiler::bind(Symbol symbol, Value * value) {
+    int slot = localSlot(symbol);
+    if (slot != -1)
+        RUNTIME_CALL(envSetSlot, env(), fromInt(slot), value);
+    else
+        RUNTIME_CALL(envSetCached, env(), fromInt(symbol), value, newCache());
+}
+
 /** Safeguard against forgotten  visitor methods.   */
 void Compiler::visit(ast::Exp * n) {
     throw "Unexpected: You are missing a visit() method.";
@@ -144,12 +293,21 @@ void Compiler::visit(ast::Num * n) {
 
 /** Similarly string is loaded as character vector and then boxed into value. */
 void Compiler::visit(ast::Str * n) {
+    // The literal is created now, running the code only reads the pool.
+    Pool::getLiteral(n->index);
     result = RUNTIME_CALL(characterVectorLiteral, fromInt(n->index));
 }
 
-/** Read the variable from environment. */
+/** Read the variable from its slot, or by name from the environment
+    through the inline cache of the site. */
 void Compiler::visit(ast::Var * n) {
-    result = RUNTIME_CALL(envGet, cur.env, fromInt(n->symbol));
+    unsigned depth;
+    unsigned slot;
+    if (resolve(n->symbol, depth, slot))
+        result = loadSlot(depth, slot, n->symbol);
+    else
+        result = RUNTIME_CALL(envGetCached, env(), fromInt(n->symbol),
+                newCache());
 }
 
 /** Compile each statement, the last one is the result. */
@@ -162,16 +320,17 @@ void Compiler::visit(ast::Seq * n) {
     environment. Box result into a value. */
 void Compiler::visit(ast::Fun * n) {
     int fi = compile(n);
-    result = RUNTIME_CALL(createFunction, fromInt(fi), cur.env);
+    result = RUNTIME_CALL(createFunction, fromInt(fi), env());
 }
 
 /** Binary expression. First compile arguments and then call respective
-    runtime function.  */
+    runtime function. The lhs has to survive evaluation of the rhs.  */
 void Compiler::visit(ast::BinExp * n) {
     n->lhs->accept(this);
-    Value * lhs = result;
+    Value * lhsSlot = protect(result);
     n->rhs->accept(this);
     Value * rhs = result;
+    Value * lhs = reload(lhsSlot);
     switch (n->op) {
         case ast::BinExp::Op::add:
             result = RUNTIME_CALL(genericAdd, lhs, rhs);
@@ -206,13 +365,17 @@ void Compiler::visit(ast::BinExp * n) {
 void Compiler::visit(ast::UserCall * n) {
 #if VERSION >= 5
     n->name->accept(this);
-    vector<Value *> args;
-    args.push_back(result);
-    args.push_back(fromInt(n->args.size()));
+    vector<Value *> slots;
+    slots.push_back(protect(result));
     for (ast::Exp * arg : n->args) {
         arg->accept(this);
-        args.push_back(result);
+        slots.push_back(protect(result));
     }
+    vector<Value *> args;
+    args.push_back(reload(slots[0]));
+    args.push_back(fromInt(n->args.size()));
+    for (unsigned i = 1; i < slots.size(); ++i)
+        args.push_back(reload(slots[i]));
     result = cur.b->CreateCall(call(m.get()), args, "");
 #endif //VERSION
 #if VERSION < 5
@@ -237,43 +400,68 @@ void Compiler::visit(ast::TypeCall * n) {
 /** Eval.  */
 void Compiler::visit(ast::EvalCall * n) {
     n->args[0]->accept(this);
-    result = RUNTIME_CALL(genericEval, cur.env, result);
+    result = RUNTIME_CALL(genericEval, env(), result);
 }
 
 /** Concatenate.  */
 void Compiler::visit(ast::CCall * n) {
-    vector<Value *> args;
-    args.push_back(fromInt(static_cast<int>(n->args.size())));
+    vector<Value *> slots;
     for (ast::Exp * arg : n->args) {
         arg->accept(this);
-        args.push_back(result);
+        slots.push_back(protect(result));
     }
+    vector<Value *> args;
+    args.push_back(fromInt(static_cast<int>(n->args.size())));
+    for (Value * slot : slots)
+        args.push_back(reload(slot));
     result = cur.b->CreateCall(c(m.get()), args, "");
 }
 
+/** Full collection, returns the statistics afterwards.  */
+void Compiler::visit(ast::GcCall * n) {
+    result = RUNTIME_CALL(gcCollect);
+}
+
+/** Statistics of the GC.  */
+void Compiler::visit(ast::GcStatsCall * n) {
+    result = RUNTIME_CALL(gcStats);
+}
+
 /** Indexed read.  */
 void Compiler::visit(ast::Index * n) {
     n->name->accept(this);
-    Value * obj = result;
+    Value * obj = protect(result);
     n->index->accept(this);
-    result = RUNTIME_CALL(genericGetElement, obj, result);
+    result = RUNTIME_CALL(genericGetElement, reload(obj), result);
 }
 
-/** Assign a variable. */
+/** Assign a variable. The value is also the result, growing the bindings
+    might move it.  */
 void Compiler::visit(ast::SimpleAssignment * n) {
     n->rhs->accept(this);
-    RUNTIME_CALL(envSet, cur.env, fromInt(n->name->symbol), result);
+    Value * rhs = protect(result);
+    bind(n->name->symbol, result);
+    result = reload(rhs);
 }
 
-/** Assign into a vector at an index. */
+/** Assign into a vector at an index. The runtime copies shared vectors and
+    boxes immediates, a variable is bound to the vector it returns. Binding
+    it locally first makes a vector of an outer environment shared, so the
+    write does not leak into it. */
 void Compiler::visit(ast::IndexAssignment * n) {
+    ast::Var * name = dynamic_cast<ast::Var*>(n->index->name);
     n->rhs->accept(this);
-    Value * rhs = result;
+    Value * rhsSlot = protect(result);
     n->index->name->accept(this);
-    Value * var = result;
+    Value * var = protect(result);
+    if (name)
+        bind(name->symbol, result);
     n->index->index->accept(this);
-    RUNTIME_CALL(genericSetElement, var, result, rhs);
-    result = rhs;
+    Value * target = RUNTIME_CALL(genericSetElement, reload(var), result,
+            reload(rhsSlot));
+    if (name)
+        bind(name->symbol, target);
+    result = reload(rhsSlot);
 }
 
 /** Conditional.  Compile the guard, convert the result to a boolean,
@@ -343,6 +531,7 @@ void Compiler::visit(ast::WhileLoop * n) {
     // compile loop body, at the end of the loop body, branch to start
     cur.b->SetInsertPoint(body);
     n->body->accept(this);
+    safepoint();
     cur.b->CreateBr(guard);
     // set the current BB to the one after the loop, the result is the
     // value of the last instruction
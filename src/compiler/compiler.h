@@ -7,6 +7,7 @@
 namespace rift {
 
 class RiftModule;
+class Layout;
 
 class Compiler : public Visitor {
 public:
@@ -46,6 +47,49 @@ private:
         return llvm::ConstantInt::get(context(), llvm::APInt(32, value));
     }
 
+    /** Stores value in a fresh slot of the function's shadow stack frame,
+        where the GC finds it and updates it if the object moves. Values
+        which are still needed after another runtime call must be protected
+        and reloaded. Returns the slot.
+     */
+    llvm::Value * protect(llvm::Value * value);
+
+    /** Loads a protected value from its slot.  */
+    llvm::Value * reload(llvm::Value * slot);
+
+    /** Loads the environment of the function from its slot.  */
+    llvm::Value * env();
+
+    /** Finds the slot of a variable read by the current function, depth
+        counts the parents of its environment to walk. Returns false if the
+        variable has to be looked up by name.
+     */
+    bool resolve(Symbol symbol, unsigned & depth, unsigned & slot);
+
+    /** Returns the slot of a variable the current function assigns to, or
+        -1 if it is bound by name.
+     */
+    int localSlot(Symbol symbol);
+
+    /** Loads the value of a resolved variable, calls envGet if the slot is
+        not bound yet.
+     */
+    llvm::Value * loadSlot(unsigned depth, unsigned slot, Symbol symbol);
+
+    /** Returns the address of a new inline cache for a call site looking
+        up a variable by name.
+     */
+    llvm::Value * newCache();
+
+    /** Lets other threads collect. Emitted at the entry of functions and
+        at the end of loop bodies, so that a thread running compiled code
+        which does not allocate still stops for them.
+     */
+    void safepoint();
+
+    /** Assigns value to a variable of the current function.  */
+    void bind(Symbol symbol, llvm::Value * value);
+
 public:
     void visit(ast::Exp * node) override;
     void visit(ast::Num * node) override;
@@ -59,6 +103,8 @@ public:
     void visit(ast::TypeCall * node) override;
     void visit(ast::EvalCall * node)  override;
     void visit(ast::CCall * node)  override;
+    void visit(ast::GcCall * node)  override;
+    void visit(ast::GcStatsCall * node)  override;
     void visit(ast::Index * node) override;
     void visit(ast::SimpleAssignment * node) override;
     void visit(ast::IndexAssignment * node) override;
@@ -72,20 +118,36 @@ private:
 
     unique_ptr<llvm::Module> m;
 
+    /** Layouts of the functions being compiled, innermost last. The
+        outermost code runs in an environment it did not create and has
+        nullptr instead.
+     */
+    vector<Layout *> scopes;
+
     /* Context for the compiler, i.e. which fuction and basic block should the instructions be added. */
     struct FunctionContext {
-        FunctionContext() : f(nullptr), env(nullptr), b(nullptr) {}
+        FunctionContext() : f(nullptr), env(nullptr), b(nullptr),
+            enterFrame(nullptr), frame(nullptr), slots(0) {}
         FunctionContext(string name, llvm::Module* m);
 
         llvm::Function * f;
+        /** Slot of the environment in the frame.  */
         llvm::Value * env;
         llvm::IRBuilder<> * b;
+        /** Call pushing the shadow stack frame. Its size is only known
+            once the whole function is compiled.  */
+        llvm::CallInst * enterFrame;
+        llvm::Value * frame;
+        unsigned slots;
 
         void restore(const FunctionContext& other) {
             if (b) delete b;
             f = other.f;
             env = other.env;
             b = other.b;
+            enterFrame = other.enterFrame;
+            frame = other.frame;
+            slots = other.slots;
         }
     };
 
@@ -13,6 +13,7 @@
 #include "type_analysis.h"
 #include "specialize.h"
 #include "die.h"
+#include "inline_alloc.h"
 #endif //VERSION
 
 namespace rift {
@@ -146,7 +147,9 @@ RUNTIME_FUNCTIONS
     }
 
     /** Optimize on the bitcode before native code generation. TypeAnalysis, 
-        Unboxing and BoxingRemoval are Rift passes, the rest is from LLVM.   */
+        Unboxing and BoxingRemoval are Rift passes, the rest is from LLVM.
+        InlineAllocation comes last, the others look for the calls it
+        replaces.  */
     static void optimizeModule(llvm::Module * m) {
 #if VERSION > 10
         auto pm = unique_ptr<llvm::legacy::FunctionPassManager>
@@ -154,6 +157,7 @@ RUNTIME_FUNCTIONS
         pm->add(new TypeAnalysis());
         pm->add(new Specialize());
         pm->add(new DeadInstructionElimination());
+        pm->add(new InlineAllocation());
         // Optimize each function of this module
         for (llvm::Function & f : *m) {
             if (not f.empty()) {
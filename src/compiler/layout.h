@@ -0,0 +1,86 @@
+#pragma once
+
+#include "ast.h"
+
+namespace rift {
+
+/** Layout is a visitor computing the fixed slots of the environment of a
+    function: its arguments in order, followed by every variable it assigns
+    to. Bodies of nested functions have layouts of their own and are not
+    entered. A function calling eval may create other variables at runtime,
+    usesEval tells the compiler to look up names it does not own by name.
+
+    Usage:  Layout l(fun);
+ */
+class Layout: public Visitor {
+public:
+    explicit Layout(ast::Fun * n): usesEval(false) {
+        for (ast::Var * v : n->args)
+            symbols.push_back(v->symbol);
+        n->body->accept(this);
+    }
+
+    /** Returns the slot of symbol, or -1 if it has none.  */
+    int slotOf(Symbol symbol) const {
+        for (unsigned i = 0; i < symbols.size(); ++i)
+            if (symbols[i] == symbol)
+                return i;
+        return -1;
+    }
+
+    void visit(ast::Seq * n) override {
+        for (ast::Exp * e : n->body)
+            e->accept(this);
+    }
+    void visit(ast::BinExp * n) override {
+        n->lhs->accept(this);
+        n->rhs->accept(this);
+    }
+    void visit(ast::Call * n) override {
+        for (ast::Exp * e : n->args)
+            e->accept(this);
+    }
+    void visit(ast::UserCall * n) override {
+        n->name->accept(this);
+        visit(static_cast<ast::Call*>(n));
+    }
+    void visit(ast::EvalCall * n) override {
+        usesEval = true;
+        visit(static_cast<ast::Call*>(n));
+    }
+    void visit(ast::Index * n) override {
+        n->name->accept(this);
+        n->index->accept(this);
+    }
+    void visit(ast::SimpleAssignment * n) override {
+        n->rhs->accept(this);
+        add(n->name->symbol);
+    }
+    void visit(ast::IndexAssignment * n) override {
+        n->rhs->accept(this);
+        n->index->accept(this);
+        if (ast::Var * name = dynamic_cast<ast::Var*>(n->index->name))
+            add(name->symbol);
+    }
+    void visit(ast::IfElse * n) override {
+        n->guard->accept(this);
+        n->ifClause->accept(this);
+        n->elseClause->accept(this);
+    }
+    void visit(ast::WhileLoop * n) override {
+        n->guard->accept(this);
+        n->body->accept(this);
+    }
+
+    /** Symbols of the slots, the arguments come first.  */
+    vector<Symbol> symbols;
+    bool usesEval;
+
+private:
+    void add(Symbol symbol) {
+        if (slotOf(symbol) == -1)
+            symbols.push_back(symbol);
+    }
+};
+
+} // namespace rift
@@ -20,15 +20,18 @@ llvm::Type * Int = llvm::IntegerType::get(Compiler::context(), 32);
 llvm::Type * Double = llvm::Type::getDoubleTy(Compiler::context());
 llvm::Type * Character = llvm::IntegerType::get(Compiler::context(), 8);
 llvm::Type * Bool = llvm::IntegerType::get(Compiler::context(), 1);
+llvm::Type * Word = llvm::IntegerType::get(Compiler::context(), 8 * sizeof(uintptr_t));
 llvm::PointerType * ptrInt = llvm::PointerType::get(Int, 0);
 llvm::PointerType * ptrCharacter = llvm::PointerType::get(Character, 0);
 llvm::PointerType * ptrDouble = llvm::PointerType::get(Double, 0);
+llvm::PointerType * ptrWord = llvm::PointerType::get(Word, 0);
 llvm::StructType * DoubleVector = STRUCT("DoubleVector", ptrDouble, Int);
 llvm::StructType * CharacterVector = STRUCT("CharacterVector", ptrCharacter, Int);
 llvm::PointerType * ptrDoubleVector = llvm::PointerType::get(DoubleVector, 0);
 llvm::PointerType * ptrCharacterVector = llvm::PointerType::get(CharacterVector, 0);
 llvm::StructType * Value = STRUCT("Value", Int, ptrDoubleVector);
 llvm::PointerType * ptrValue = llvm::PointerType::get(Value, 0);
+llvm::PointerType * ptrPtrValue = llvm::PointerType::get(ptrValue, 0);
 llvm::StructType * Binding = STRUCT("Binding", Int, ptrValue);
 llvm::PointerType * ptrBinding = llvm::PointerType::get(Binding, 0);
 llvm::PointerType * ptrEnvironment;
@@ -36,6 +39,7 @@ llvm::StructType * Environment = environmentType();
 llvm::FunctionType * NativeCode = FUN_TYPE(ptrValue, ptrEnvironment);
 llvm::StructType * Function = STRUCT("Function", ptrEnvironment, NativeCode, ptrInt, Int);
 llvm::PointerType * ptrFunction = llvm::PointerType::get(Function, 0);
+llvm::FunctionType * v = FUN_TYPE(ptrValue);
 llvm::FunctionType * v_i = FUN_TYPE(ptrValue, Int);
 llvm::FunctionType * v_dv = FUN_TYPE(ptrValue, ptrDoubleVector);
 llvm::FunctionType * v_d = FUN_TYPE(ptrValue, Double);
@@ -51,6 +55,8 @@ llvm::FunctionType * v_ecv = FUN_TYPE(ptrValue, ptrEnvironment, ptrCharacterVect
 llvm::FunctionType * v_cvcv = FUN_TYPE(ptrValue, ptrCharacterVector, ptrCharacterVector);
 llvm::FunctionType * v_dvdv = FUN_TYPE(ptrValue, ptrDoubleVector, ptrDoubleVector);
 llvm::FunctionType * void_eiv = FUN_TYPE(Void, ptrEnvironment, Int, ptrValue);
+llvm::FunctionType * v_eipc = FUN_TYPE(ptrValue, ptrEnvironment, Int, ptrCharacter);
+llvm::FunctionType * void_eivpc = FUN_TYPE(Void, ptrEnvironment, Int, ptrValue, ptrCharacter);
 llvm::FunctionType * d_dvd = FUN_TYPE(Double, ptrDoubleVector, Double);
 llvm::FunctionType * v_f = FUN_TYPE(ptrValue, ptrFunction);
 llvm::FunctionType * v_ie = FUN_TYPE(ptrValue, Int, ptrEnvironment);
@@ -63,6 +69,10 @@ llvm::FunctionType * void_cvdvcv = FUN_TYPE(Void, ptrCharacterVector, ptrDoubleV
 llvm::FunctionType * void_dvdd = FUN_TYPE(Void, ptrDoubleVector, Double, Double);
 llvm::FunctionType * d_v = FUN_TYPE(Double, ptrValue);
 llvm::FunctionType * v_iVA = FUN_TYPE_VARARG(ptrValue, Int);
+llvm::FunctionType * pv_i = FUN_TYPE(ptrPtrValue, Int);
+llvm::FunctionType * void_pv = FUN_TYPE(Void, ptrPtrValue);
+llvm::FunctionType * pw = FUN_TYPE(ptrWord);
+llvm::FunctionType * void_ = FUN_TYPE(Void);
 llvm::FunctionType * d_dv = FUN_TYPE(Double, ptrDoubleVector);
 llvm::FunctionType * f_v = FUN_TYPE(ptrFunction, ptrValue);
 llvm::StructType * environmentType() {
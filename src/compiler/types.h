@@ -11,10 +11,13 @@ extern llvm::Type * Int;
 extern llvm::Type * Double;
 extern llvm::Type * Character;
 extern llvm::Type * Bool;
+/** Integer of the size of a pointer. */
+extern llvm::Type * Word;
 
 extern llvm::PointerType * ptrInt;
 extern llvm::PointerType * ptrCharacter;
 extern llvm::PointerType * ptrDouble;
+extern llvm::PointerType * ptrWord;
 
 extern llvm::StructType *  DoubleVector;
 extern llvm::StructType *  CharacterVector;
@@ -26,6 +29,7 @@ extern llvm::PointerType * ptrCharacterVector;
 */
 extern llvm::StructType *  Value;
 extern llvm::PointerType * ptrValue;
+extern llvm::PointerType * ptrPtrValue;
 
 extern llvm::StructType *  Binding;
 extern llvm::PointerType * ptrBinding;
@@ -49,8 +53,13 @@ extern llvm::PointerType * ptrFunction;
       cv = character vector *
       e = Environment *
       v = Value *
+      pv = Value ** (a shadow stack frame)
+      pw = word * (the allocation buffer of the thread)
+      pc = EnvCache * (the inline cache of a call site, opaque to llvm)
       f = Function *
+    A function without arguments has only the return type in its name.
   */
+extern llvm::FunctionType * v;
 extern llvm::FunctionType * v_i;
 extern llvm::FunctionType * v_dv;
 extern llvm::FunctionType * v_d;
@@ -66,6 +75,8 @@ extern llvm::FunctionType * v_ecv;
 extern llvm::FunctionType * v_cvcv;
 extern llvm::FunctionType * v_dvdv;
 extern llvm::FunctionType * void_eiv;
+extern llvm::FunctionType * v_eipc;
+extern llvm::FunctionType * void_eivpc;
 extern llvm::FunctionType * d_dvd;
 extern llvm::FunctionType * v_f;
 extern llvm::FunctionType * v_ie;
@@ -78,6 +89,10 @@ extern llvm::FunctionType * void_cvdvcv;
 extern llvm::FunctionType * v_cvdv;
 extern llvm::FunctionType * d_v;
 extern llvm::FunctionType * v_iVA;
+extern llvm::FunctionType * pv_i;
+extern llvm::FunctionType * void_pv;
+extern llvm::FunctionType * pw;
+extern llvm::FunctionType * void_;
 extern llvm::FunctionType * d_dv;
 extern llvm::FunctionType * f_v;
 }
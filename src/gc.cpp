@@ -1,3 +1,9 @@
+#include <chrono>
+#include <iomanip>
+#include <limits>
+
+#include <pthread.h>
+
 #include "gc.h"
 #include "runtime.h"
 
@@ -5,22 +11,67 @@ namespace gc {
 
 static_assert(Page::blockSize >= sizeof(DoubleVector) + sizeof(double), "");
 static_assert(Page::blockSize >= sizeof(Environment), "");
+static_assert(Page::blockSize >= sizeof(RFun), "");
+static_assert(sizeof(Bindings::Binding) == 8, "");
+static_assert(sizeof(DoubleVector) == LargeObjectSpace::payloadOffset, "");
+static_assert(sizeof(CharacterVector) == LargeObjectSpace::payloadOffset, "");
 
-void GarbageCollector::visitChildren(RVal* val) {
+size_t objSize(RVal* val) {
+    switch (val->type) {
+        case Type::Double:
+            return sizeof(DoubleVector) +
+                static_cast<DoubleVector*>(val)->size * DoubleVector::ELEMENT_SIZE;
+        case Type::Character:
+            return sizeof(CharacterVector) +
+                (static_cast<CharacterVector*>(val)->size + 1) *
+                CharacterVector::ELEMENT_SIZE;
+        case Type::Function:
+            return sizeof(RFun);
+        case Type::FunctionArgs:
+            return sizeof(FunctionArgs) +
+                static_cast<FunctionArgs*>(val)->slots * FunctionArgs::ELEMENT_SIZE;
+        case Type::Environment:
+            return sizeof(Environment) +
+                static_cast<Environment*>(val)->size * Environment::ELEMENT_SIZE;
+        case Type::Bindings:
+            return sizeof(Bindings) +
+                static_cast<Bindings*>(val)->available * Bindings::ELEMENT_SIZE;
+        default:
+            assert(false && "Broken RVal");
+            return 0;
+    }
+}
+
+// Fields hold compressed references, f gets the address of a full pointer.
+// The field is updated if f changes it. Immediates are skipped.
+template <typename T, typename F>
+static void visitRef(HeapRef<T>& ref, F& f) {
+    RVal* val = ref;
+    if (!val || isImmediate(val))
+        return;
+    f(&val);
+    if (val != ref)
+        ref = static_cast<T*>(val);
+}
+
+// Calls f with the address of every heap pointer stored in val. Types
+// without pointers have to be listed in isLeaf().
+template <typename F>
+static void forEachSlot(RVal* val, F f) {
     switch (val->type) {
         case Type::Environment: {
             Environment* env = (Environment*)val;
-            if (env->bindings)
-                mark(env->bindings);
-            if (env->parent)
-                mark(env->parent);
+            visitRef(env->bindings, f);
+            visitRef(env->parent, f);
+            for (unsigned i = 0; i < env->size; ++i)
+                visitRef(env->slot[i].value, f);
             break;
         }
 
         case Type::Bindings: {
             Bindings* env = (Bindings*)val;
             for (unsigned i = 0; i < env->size; ++i) {
-                mark(env->binding[i].value);
+                visitRef(env->binding[i].value, f);
             }
             break;
         }
@@ -28,10 +79,8 @@ void GarbageCollector::visitChildren(RVal* val) {
 
         case Type::Function: {
             RFun* fun = (RFun*)val;
-            if (fun->args)
-                mark(fun->args);
-            if (fun->env)
-                mark(fun->env);
+            visitRef(fun->args, f);
+            visitRef(fun->env, f);
             break;
         }
 
@@ -46,29 +95,801 @@ void GarbageCollector::visitChildren(RVal* val) {
     }
 }
 
+uintptr_t HeapRegion::base = 0;
+
+HeapRegion::HeapRegion() {
+    // Only address space is reserved, memory is mapped by take().
+    void* mem = mmap(nullptr, size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        throw bad_alloc();
+    base = reinterpret_cast<uintptr_t>(mem);
+    if (base < size) {
+        munmap(mem, size);
+        throw bad_alloc();
+    }
+    unused[base + guardBytes] = size - guardBytes;
+}
+
+void* HeapRegion::take(size_t bytes, size_t align) {
+    HeapRegion& r = inst();
+    lock_guard<mutex> guard(r.lock);
+    // First fit, the lowest addresses are used first.
+    for (auto ui = r.unused.begin(); ui != r.unused.end(); ++ui) {
+        uintptr_t start = ui->first;
+        uintptr_t end = start + ui->second;
+        uintptr_t mem = (start + align - 1) & ~(align - 1);
+        if (mem + bytes > end)
+            continue;
+        // Mapped before the range is taken out of unused, it stays there
+        // if mapping fails.
+        if (mmap(reinterpret_cast<void*>(mem), bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            throw bad_alloc();
+        r.unused.erase(ui);
+        if (mem > start)
+            r.unused[start] = mem - start;
+        if (mem + bytes < end)
+            r.unused[mem + bytes] = end - mem - bytes;
+        return reinterpret_cast<void*>(mem);
+    }
+    throw bad_alloc();
+}
+
+void HeapRegion::release(void* mem, size_t bytes) {
+    HeapRegion& r = inst();
+    lock_guard<mutex> guard(r.lock);
+    // Mapping fresh inaccessible memory over it drops the pages. If that
+    // fails the range stays accessible, but its pages are dropped all the
+    // same, take() maps over it again anyway.
+    if (mmap(mem, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+             MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        int res __attribute__((unused)) = madvise(mem, bytes, MADV_DONTNEED);
+        assert(res == 0 && "cannot release heap memory");
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(mem);
+    auto next = r.unused.lower_bound(start);
+    if (next != r.unused.end() && next->first == start + bytes) {
+        bytes += next->second;
+        next = r.unused.erase(next);
+    }
+    if (next != r.unused.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == start) {
+            prev->second += bytes;
+            return;
+        }
+    }
+    r.unused[start] = bytes;
+}
+
+thread_local Mutator* GarbageCollector::current = nullptr;
+
+// Held by allocSlow and by the entry points which collect.
+class GarbageCollector::HeapLock {
+public:
+    HeapLock(GarbageCollector& gc, Mutator& m) : gc(gc) {
+        gc.lockHeap(m);
+    }
+
+    ~HeapLock() {
+        gc.unlockHeap();
+    }
+
+private:
+    GarbageCollector& gc;
+};
+
+// Keeps all other threads stopped for its lifetime. Nested stops are no-ops.
+class GarbageCollector::WorldStop {
+public:
+    explicit WorldStop(GarbageCollector& gc) : gc(gc), owner(gc.stopWorld()) { }
+
+    ~WorldStop() {
+        if (owner)
+            gc.resumeWorld();
+    }
+
+private:
+    GarbageCollector& gc;
+    bool owner;
+};
+
+RVal* GarbageCollector::allocSlow(Mutator& m, size_t sz, Type type) {
+    HeapLock lock(*this, m);
+    flush(m);
+
+    if (sz <= Nursery::maxObjSize) {
+        // If all blocks got promoted there is nothing to collect and we
+        // fall back to the old generation.
+        Nursery::Block* block = m.tlab;
+        if (nursery.refill(block) || (nursery.used() &&
+                    (minorGc(), nursery.refill(block)))) {
+            setBuffer(m, block);
+            return doAlloc(m, sz, type);
+        }
+    }
+    RVal* res = doAllocOld(sz, type);
+    res->type = type;
+    m.allocated.add(res, sz);
+    return res;
+}
+
+void GarbageCollector::flush(Mutator& m) {
+    Nursery::record(m.tlab, m.buffer.top, [&m] (RVal* obj, size_t sz) {
+        m.allocated.add(obj, sz);
+        m.youngAllocated.add(obj, sz);
+    });
+}
+
+void GarbageCollector::lockHeap(Mutator& m) {
+    if (heapLock.try_lock())
+        return;
+    // Whoever holds the lock might collect while we wait, our registers
+    // have to be on the stack then.
+    jmp_buf registers;
+    setjmp(registers);
+    enterSafeRegion(m, &registers);
+    heapLock.lock();
+    leaveSafeRegion();
+}
+
+bool GarbageCollector::stopWorld() {
+    if (worldStopped)
+        return false;
+    {
+        unique_lock<mutex> l(stateLock);
+        stopRequested.store(true, memory_order_release);
+        stopped.wait(l, [this] { return parked == mutators.size() - 1; });
+    }
+    worldStopped = true;
+
+    for (auto m : mutators) {
+        flush(*m);
+        remset.insert(remset.end(), m->remset.begin(), m->remset.end());
+        m->remset.clear();
+        // The barrier marked these already.
+        markStack.insert(markStack.end(), m->grey.begin(), m->grey.end());
+        m->grey.clear();
+    }
+    return true;
+}
+
+void GarbageCollector::resumeWorld() {
+    worldStopped = false;
+    {
+        lock_guard<mutex> l(stateLock);
+        stopRequested.store(false, memory_order_release);
+    }
+    resumed.notify_all();
+}
+
+void GarbageCollector::park(Mutator& m) {
+    jmp_buf registers;
+    setjmp(registers);
+    enterSafeRegion(m, &registers);
+    leaveSafeRegion();
+}
+
+void GarbageCollector::enterSafeRegion(Mutator& m, void const * stackTop) {
+    m.stackTop = stackTop;
+    {
+        lock_guard<mutex> l(stateLock);
+        ++parked;
+    }
+    stopped.notify_one();
+}
+
+void GarbageCollector::leaveSafeRegion() {
+    unique_lock<mutex> l(stateLock);
+    resumed.wait(l, [this] {
+        return !stopRequested.load(memory_order_relaxed);
+    });
+    --parked;
+}
+
+void GarbageCollector::attach(Mutator& m) {
+    GarbageCollector& gc = inst();
+    assert(current == nullptr && "thread is already attached");
+    setBuffer(m, gc.nursery.exhaustedBlock());
+    m.stackBase = stackBase();
+    // The thread is not attached yet, a collection does not wait for it.
+    lock_guard<mutex> l(gc.heapLock);
+    gc.mutators.push_back(&m);
+    current = &m;
+}
+
+void GarbageCollector::detach(Mutator& m) {
+    GarbageCollector& gc = inst();
+    HeapLock lock(gc, m);
+    gc.flush(m);
+    gc.detachedAllocated += m.allocated;
+    gc.detachedYoungAllocated += m.youngAllocated;
+    gc.remset.insert(gc.remset.end(), m.remset.begin(), m.remset.end());
+    gc.markStack.insert(gc.markStack.end(), m.grey.begin(), m.grey.end());
+    gc.mutators.erase(find(gc.mutators.begin(), gc.mutators.end(), &m));
+    current = nullptr;
+}
+
+void GarbageCollector::enterBlocking(void const * stackTop) {
+    inst().enterSafeRegion(mutator(), stackTop);
+}
+
+void GarbageCollector::leaveBlocking() {
+    inst().leaveSafeRegion();
+}
+
+void GarbageCollector::collect() {
+    GarbageCollector& gc = inst();
+    HeapLock lock(gc, mutator());
+    gc.doGc();
+}
+
+void GarbageCollector::addRoot(RVal** slot) {
+    GarbageCollector& gc = inst();
+    HeapLock lock(gc, mutator());
+    gc.roots.push_back(slot);
+}
+
+void GarbageCollector::addRoots(RootSet* set) {
+    GarbageCollector& gc = inst();
+    HeapLock lock(gc, mutator());
+    gc.rootSets.push_back(set);
+}
+
+void GarbageCollector::removeRoots(RootSet* set) {
+    GarbageCollector& gc = inst();
+    HeapLock lock(gc, mutator());
+    auto i = find(gc.rootSets.begin(), gc.rootSets.end(), set);
+    assert(i != gc.rootSets.end());
+    gc.rootSets.erase(i);
+}
+
+void GarbageCollector::visitChildren(RVal* val) {
+    forEachSlot(val, [this] (RVal** slot) {
+        shade(*slot);
+    });
+}
+
+void GarbageCollector::scavenge(RVal** slot) {
+    RVal* val = *slot;
+    if (!nursery.isYoung(val))
+        return;
+
+    if (nursery.block(reinterpret_cast<uintptr_t>(val)).pinned) {
+        if (val->mark != MARKED) {
+            val->mark = MARKED;
+            grey.push_back(val);
+        }
+        return;
+    }
+
+    if (val->mark == FORWARDED) {
+        *slot = Nursery::forwardee(val);
+        return;
+    }
+
+    size_t sz = objSize(val);
+    RVal* copy = arena.alloc(sz, isLeaf(val->type), true);
+    memcpy(copy, val, sz);
+    copy->mark = UNMARKED;
+
+    val->mark = FORWARDED;
+    Nursery::forwardee(val) = copy;
+    *slot = copy;
+    grey.push_back(copy);
+    // Survivors are allocated black while the old generation is marked.
+    if (marking)
+        shade(copy);
+}
+
+// Copying collection of the nursery. Roots are the shadow stack, registered
+// slots and the remembered set, and in conservative mode the C stack. All
+// survivors end up in the old generation, so afterwards the remembered set
+// is empty.
+void GarbageCollector::scavenge() {
+    scavenging = true;
+
+    // The stack scan pins blocks, so it has to happen before anything is
+    // moved.
+    if (conservative)
+        scanStack();
+
+    // After a minor gc all objects on the shadow stack are old, only the
+    // slots which changed since can point to young ones.
+    forEachRoot([this] (RVal** slot) {
+        scavenge(slot);
+    });
+#ifdef GC_DEBUG
+    size_t changed = 0;
+#endif
+    for (auto m : mutators) {
+#ifdef GC_DEBUG
+        changed += m->shadow.changedSlots();
+        m->shadow.forEachUnchanged([this] (RVal** slot) {
+            assert(!nursery.isYoung(*slot) && "unreported shadow slot write");
+        });
+#endif
+        m->shadow.forEachChanged([this] (RVal** slot) {
+            scavenge(slot);
+        });
+        m->shadow.rescanned();
+    }
+#ifdef GC_DEBUG
+    cout << "scavenged " << changed << " shadow stack slots\n";
+#endif
+
+    for (auto obj : remset) {
+        obj->remembered = false;
+        forEachSlot(obj, [this] (RVal** slot) {
+            scavenge(slot);
+        });
+    }
+    remset.clear();
+
+    // Every survivor passes through the grey list once.
+    TypeBytes survived;
+    while (!grey.empty()) {
+        RVal* obj = grey.back();
+        grey.pop_back();
+        survived.add(obj, objSize(obj));
+        // Pinned objects are promoted with their mark bit set, the marker
+        // still has to visit their fields.
+        if (marking && nursery.isYoung(obj))
+            markStack.push_back(obj);
+        forEachSlot(obj, [this] (RVal** slot) {
+            scavenge(slot);
+        });
+    }
+
+    nursery.finishScavenge(marking);
+    scavenging = false;
+
+    TypeBytes young = detachedYoungAllocated;
+    detachedYoungAllocated = TypeBytes();
+    for (auto m : mutators) {
+        young += m->youngAllocated;
+        m->youngAllocated = TypeBytes();
+        setBuffer(*m, nursery.exhaustedBlock());
+    }
+    for (size_t t = 0; t < youngFreed.bytes.size(); ++t)
+        youngFreed.bytes[t] += young.bytes[t] - survived.bytes[t];
+}
+
+void GarbageCollector::minorGc() {
+    WorldStop stop(*this);
+    auto start = chrono::high_resolution_clock::now();
+#ifdef GC_DEBUG
+    verify();
+#endif
+
+    scavenge();
+    // The arena is swept a bit after every minor gc, so that little is left
+    // when the next full gc starts.
+    if (arena.sweeping())
+        sweepStep();
+    if (!arena.sweeping())
+        finishSweep();
+
+#ifdef GC_DEBUG
+    verify();
+    cout << "minor gc, old generation " << size() << "b\n";
+#endif
+    chrono::duration<double> t = chrono::high_resolution_clock::now() - start;
+    minorPauses_.record(t.count());
+    pacer.minorPause(t.count());
+
+    // A full gc might release promoted blocks back to the nursery.
+    if (!nursery.hasFree())
+        doGc();
+    else if (marking || size() > heapLimit)
+        collectOld();
+}
+
 // The core mark & sweep algorithm
 void GarbageCollector::doGc() {
+    WorldStop stop(*this);
+    auto start = chrono::high_resolution_clock::now();
+
+    if (!marking)
+        startMarking();
+    finishMarking();
+
+    chrono::duration<double> t = chrono::high_resolution_clock::now() - start;
+    majorPauses_.record(t.count());
+    pacer.majorPause(t.count());
+}
+
+void GarbageCollector::collectOld() {
+    // Garbage in pages which are not swept yet still counts towards the heap
+    // size.
+    if (!marking && arena.sweeping()) {
+        finishSweep();
+        if (size() <= heapLimit)
+            return;
+    }
+
+    if (pauseTarget == 0 ||
+            (marking && size() > heapLimit * HEAP_HARD_RATIO))
+        doGc();
+    else
+        markStep();
+}
+
+void GarbageCollector::markStep() {
+    WorldStop stop(*this);
+    auto start = chrono::high_resolution_clock::now();
+
+    if (!marking)
+        startMarking();
+    else if (drainMarkStack(pauseTarget))
+        finishMarking();
+
+    chrono::duration<double> t = chrono::high_resolution_clock::now() - start;
+    majorPauses_.record(t.count());
+    pacer.majorPause(t.count());
+}
+
+void GarbageCollector::startMarking() {
+    // Empty the nursery first, then only the old generation needs to be
+    // collected.
+    if (nursery.used())
+        scavenge();
+
+    finishSweep();
+    pacer.markingStarted(size() - free());
+
 #ifdef GC_DEBUG
-    unsigned memUsage = size() - free();
     verify();
 #endif
 
-    mark();
+    marking = true;
+    markRoots();
+}
+
+void GarbageCollector::markRoots() {
+    forEachRoot([this] (RVal** slot) {
+        shade(*slot);
+    });
+    forEachShadowSlot([this] (RVal** slot) {
+        shade(*slot);
+    });
+    if (conservative)
+        scanStack();
+}
+
+bool GarbageCollector::drainMarkStack(double budget) {
+    auto start = chrono::high_resolution_clock::now();
+    // Checking the clock is not free, only do it every so many objects.
+    constexpr unsigned checkInterval = 256;
+    // Waking up the marking threads only pays off for bigger object graphs.
+    constexpr unsigned parallelThreshold = 4096;
+
+    unsigned visited = 0;
+    while (!markStack.empty()) {
+        if (visited == parallelThreshold && marker.threads() > 1) {
+            chrono::duration<double> t =
+                chrono::high_resolution_clock::now() - start;
+            return marker.drain(markStack, budget - t.count());
+        }
+        RVal* obj = markStack.back();
+        markStack.pop_back();
+        visitChildren(obj);
+        if (++visited % checkInterval == 0) {
+            chrono::duration<double> t =
+                chrono::high_resolution_clock::now() - start;
+            if (t.count() > budget)
+                return markStack.empty();
+        }
+    }
+    return true;
+}
+
+void GarbageCollector::finishMarking() {
+    // Young objects are promoted marked, stores into the roots and the stack
+    // are not covered by the barrier, so they are scanned again.
+    if (nursery.used())
+        scavenge();
+    markRoots();
+    drainMarkStack(numeric_limits<double>::infinity());
+    marking = false;
+    collections++;
 
 #ifdef GC_DEBUG
     verify();
 #endif
 
+    // Only the mark bits tell how many objects survive, they are gone once
+    // the pages are swept.
+    bool fragmented = arena.fragmented();
     sweep();
+    if (fragmented) {
+        arena.finishSweep();
+        compact();
+    }
+
+    resizePending = true;
+}
+
+// Mostly-copying compaction in the style of Bartlett: objects are moved out
+// of sparse pages, unless the conservative stack scan pins their page. Then
+// every slot holding a moved object is updated, which needs a pass over all
+// objects of the old generation. The nursery is empty at this point.
+void GarbageCollector::compact() {
+    if (conservative) {
+        compacting = true;
+        scanStack();
+        compacting = false;
+    }
+
+#ifdef GC_DEBUG
+    size_t before = arena.pageCount();
+#endif
+
+    if (arena.selectEvacuation()) {
+        compactions++;
+        arena.forEachEvacuated([this] (RVal* obj) {
+            size_t sz = objSize(obj);
+            RVal* copy = arena.alloc(sz, isLeaf(obj->type), true);
+            memcpy(copy, obj, sz);
+            copy->mark = UNMARKED;
+
+            obj->mark = FORWARDED;
+            Nursery::forwardee(obj) = copy;
+        });
+
+        auto update = [] (RVal** slot) {
+            if (*slot && !isImmediate(*slot) && (*slot)->mark == FORWARDED)
+                *slot = Nursery::forwardee(*slot);
+        };
+        auto updateFields = [&update] (RVal* obj) {
+            forEachSlot(obj, update);
+        };
+        forEachRoot(update);
+        forEachShadowSlot(update);
+        arena.forEachPointerObject(updateFields);
+        los.forEach(updateFields);
+        nursery.forEachPromoted(updateFields);
+    }
+    arena.finishEvacuation();
+
+#ifdef GC_DEBUG
+    verify();
+    cout << "compacted the arena from " << before << " to "
+         << arena.pageCount() << " pages\n";
+#endif
+}
+
+void GarbageCollector::sweepStep() {
+    auto start = chrono::high_resolution_clock::now();
+    // Pages are swept in batches, checking the clock for each page would
+    // cost more than sweeping it.
+    constexpr size_t batch = 32;
+
+    while (!arena.sweepSome(batch)) {
+        chrono::duration<double> t =
+            chrono::high_resolution_clock::now() - start;
+        if (t.count() > pauseTarget)
+            return;
+    }
+}
+
+void GarbageCollector::finishSweep() {
+#ifdef GC_DEBUG
+    unsigned memUsage = size() - free();
+#endif
+
+    arena.finishSweep();
 
 #ifdef GC_DEBUG
     verify();
     unsigned memUsage2 = size() - free();
     assert(memUsage2 <= memUsage);
-    cout << "reclaiming " << memUsage - memUsage2
-              << "b, used " << memUsage2 << "b, total "
-              << size() << "b in "
-              << arena.pageList.size() << " pages\n";
+    if (resizePending)
+        cout << "reclaiming " << memUsage - memUsage2
+                  << "b, used " << memUsage2 << "b, total "
+                  << size() << "b in "
+                  << arena.pageCount() << " pages and "
+                  << los.count() << " large objects\n";
+#endif
+
+    if (resizePending) {
+        heapLimit = pacer.finishCycle(size() - free(), minHeapSize);
+        resizePending = false;
+
+        chrono::duration<double> t = chrono::steady_clock::now() - startTime;
+        heapSamples.push_back({t.count(), size(), heapLimit, size() - free()});
+        if (heapSamples.size() > maxHeapSamples)
+            heapSamples.pop_front();
+    }
+}
+
+size_t HeapPacer::finishCycle(size_t live, size_t minHeapSize) {
+    auto now = chrono::steady_clock::now();
+    chrono::duration<double> window = markStart - cycleStart;
+    chrono::duration<double> cycle = now - cycleStart;
+    double mutatorTime = window.count() - minorTimeAtMark - majorTimeAtMark;
+    double cost = majorTime - majorTimeAtMark;
+
+    // Explicit collections can start a cycle before anything was promoted,
+    // they only tell the cost.
+    double cycleRate = rate;
+    if (mutatorTime > 0 && usedAtMark > lastLive)
+        cycleRate = (usedAtMark - lastLive) / mutatorTime;
+    double cycleCost = cost / max(live, size_t(Page::size));
+    if (measured) {
+        rate = smoothing * cycleRate + (1 - smoothing) * rate;
+        costPerByte = smoothing * cycleCost + (1 - smoothing) * costPerByte;
+    } else {
+        rate = cycleRate;
+        costPerByte = cycleCost;
+        measured = true;
+    }
+    measuredOverhead = cycle.count() > 0 ? majorTime / cycle.count() : 0;
+
+    double headroom = rate * costPerByte * live * (1 - overhead) / overhead;
+    headroom = min(max(headroom, live * minGrowth), live * maxGrowth);
+
+#ifdef GC_DEBUG
+    cout << "pacer: " << live << "b live, cycle of " << cycle.count() * 1e3
+         << "ms with " << cost * 1e3 << "ms marking, " << rate
+         << "b/s promoted, headroom " << static_cast<size_t>(headroom)
+         << "b\n";
+#endif
+
+    cycleStart = now;
+    lastLive = live;
+    minorTime = 0;
+    majorTime = 0;
+    return max(live + static_cast<size_t>(headroom), minHeapSize);
+}
+
+GarbageCollector::Stats GarbageCollector::stats() {
+    GarbageCollector& gc = inst();
+    // The counters of the other threads are only stable while they stop.
+    HeapLock lock(gc, mutator());
+    WorldStop stop(gc);
+    Stats s;
+    s.minor = gc.minorPauses_;
+    s.major = gc.majorPauses_;
+    s.collections = gc.collections;
+    s.compactions = gc.compactions;
+    s.allocated = gc.detachedAllocated;
+    for (auto m : gc.mutators)
+        s.allocated += m->allocated;
+    s.freed = gc.youngFreed;
+    s.freed += gc.arena.freedBytes();
+    s.freed += gc.los.freedBytes();
+    s.freed += gc.nursery.freedBytes();
+    s.heapSize = gc.size();
+    s.heapLimit = gc.heapLimit;
+    s.promotionRate = gc.pacer.promotionRate();
+    s.gcOverhead = gc.pacer.lastOverhead();
+    s.targetOverhead = gc.pacer.targetOverhead();
+    s.arenaPages = gc.arena.pageCount();
+    s.leafPages = gc.arena.leafPageCount();
+    s.retainedPages = gc.arena.retainedCount();
+    s.permanentSize = gc.permanent.size();
+    s.classes = gc.arena.classStats();
+    s.largeObjects = gc.los.count();
+    s.promotedBlocks = gc.nursery.promotedBlocks();
+    s.heap = gc.heapSamples;
+    return s;
+}
+
+void GarbageCollector::printStats(ostream & out) {
+    static const char* typeNames[] = {"invalid", "double", "character",
+        "function", "arguments", "environment", "bindings"};
+    static_assert(sizeof(typeNames) / sizeof(typeNames[0]) ==
+            static_cast<size_t>(Type::End), "");
+    // Only the latest samples of the heap size are shown.
+    constexpr size_t heapRows = 8;
+
+    Stats s = stats();
+    out << "collections: " << s.minor.count << " minor, " << s.collections
+        << " major (" << s.major.count << " pauses), " << s.compactions
+        << " compacting" << endl;
+    out << "heap: " << s.heapSize << "b of " << s.heapLimit << "b limit, "
+        << s.arenaPages << " pages (" << s.leafPages << " leaf, "
+        << s.retainedPages << " free retained), " << s.largeObjects
+        << " large objects, " << s.promotedBlocks << " promoted blocks"
+        << endl;
+    out << "permanent: " << s.permanentSize << "b" << endl;
+    out << "pacer: " << s.gcOverhead * 100 << "% of the last cycle in full gcs"
+        << " (target " << s.targetOverhead * 100 << "%), promoting "
+        << s.promotionRate << "b/s" << endl;
+
+    out << endl << setw(12) << "type" << setw(16) << "allocated b"
+        << setw(16) << "freed b" << endl;
+    for (size_t t = 1; t < static_cast<size_t>(Type::End); ++t)
+        out << setw(12) << typeNames[t] << setw(16) << s.allocated.bytes[t]
+            << setw(16) << s.freed.bytes[t] << endl;
+    out << setw(12) << "total" << setw(16) << s.allocated.total()
+        << setw(16) << s.freed.total() << endl;
+
+    out << endl << setw(12) << "pause <" << setw(10) << "minor"
+        << setw(10) << "major" << endl;
+    for (size_t b = 0; b < PauseStats::buckets; ++b) {
+        if (!s.minor.histogram[b] && !s.major.histogram[b])
+            continue;
+        if (b == PauseStats::buckets - 1)
+            out << setw(12) << "longer";
+        else
+            out << setw(10) << PauseStats::bucketLimit(b) * 1e6 << "us";
+        out << setw(10) << s.minor.histogram[b]
+            << setw(10) << s.major.histogram[b] << endl;
+    }
+    out << setw(12) << "avg ms" << setw(10) << s.minor.average() * 1e3
+        << setw(10) << s.major.average() * 1e3 << endl;
+    out << setw(12) << "max ms" << setw(10) << s.minor.max * 1e3
+        << setw(10) << s.major.max * 1e3 << endl;
+
+    // Internal bytes are lost rounding objects up to their cell, stranded
+    // bytes are free cells in pages which only that class can use.
+    out << endl << setw(12) << "cell b" << setw(10) << "pages"
+        << setw(10) << "used %" << setw(14) << "internal b"
+        << setw(14) << "stranded b" << endl;
+    size_t wasted = 0;
+    for (SizeClass c = 0; c < Arena::numClasses; ++c) {
+        auto const & cs = s.classes[c];
+        if (!cs.pages)
+            continue;
+        size_t cell = Arena::cellBytes(c);
+        size_t internal = cs.liveCells * cell - cs.liveBytes;
+        size_t stranded = (cs.cells - cs.liveCells) * cell;
+        wasted += internal + stranded;
+        out << setw(12) << cell << setw(10) << cs.pages
+            << setw(10) << 100 * cs.liveCells / cs.cells
+            << setw(14) << internal << setw(14) << stranded << endl;
+    }
+    if (s.arenaPages)
+        out << "fragmentation: " << 100 * wasted / (s.arenaPages * Page::size)
+            << "% of the arena" << endl;
+
+    if (s.heap.empty())
+        return;
+    out << endl << setw(12) << "time s" << setw(12) << "size b"
+        << setw(12) << "limit b" << setw(12) << "live b" << endl;
+    size_t first = s.heap.size() > heapRows ? s.heap.size() - heapRows : 0;
+    for (size_t i = first; i < s.heap.size(); ++i)
+        out << setw(12) << s.heap[i].time << setw(12) << s.heap[i].size
+            << setw(12) << s.heap[i].limit << setw(12) << s.heap[i].live
+            << endl;
+}
+
+#ifdef __GNUG__
+const void * GarbageCollector::stackBase() {
+#ifdef __APPLE__
+    return pthread_get_stackaddr_np(pthread_self());
+#else
+    pthread_attr_t attr;
+    void * addr = nullptr;
+    size_t size = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+    }
+    if (!addr)
+        return __builtin_frame_address(0);
+    return static_cast<uint8_t*>(addr) + size;
+#endif
+}
+#endif
+
+void GarbageCollector::scanStack(void* const * from, void const * to) {
+#ifdef GC_DEBUG
+    unsigned found = 0;
+#endif
+    void* const * p;
+    for (p = from; p < to; ++p) {
+#ifdef GC_DEBUG
+        if (findObj(*p))
+            found++;
+#endif
+        scanRoot(*p);
+    }
+#ifdef GC_DEBUG
+    printf("scanned %lu slots, found %u objs\n", p - from, found);
 #endif
 }
 
@@ -86,32 +907,262 @@ void GarbageCollector::scanStack() {
         : "%rax", "%rbx", "%rcx", "%rdx", "%rsi", "%rdi",
         "%r8", "%r9", "%r10", "%r11", "%r12",
         "%r13", "%r14", "%r15");
+
+    // Parked threads spilled their registers when they stopped.
+    for (auto m : mutators)
+        if (m != current)
+            scanStack(static_cast<void* const *>(m->stackTop), m->stackBase);
+}
+
+void ParallelMarker::setThreads(unsigned n) {
+    assert(n > 0);
+    stopWorkers();
+    deques.clear();
+    for (unsigned i = 0; i < n; ++i)
+        deques.emplace_back(new MarkDeque);
+}
+
+void ParallelMarker::startWorkers() {
+    shutdown = false;
+    for (unsigned i = 1; i < deques.size(); ++i)
+        workers.emplace_back(&ParallelMarker::workerMain, this, i, round);
+}
+
+void ParallelMarker::stopWorkers() {
+    {
+        lock_guard<mutex> l(lock);
+        shutdown = true;
+    }
+    wake.notify_all();
+    for (auto & w : workers)
+        w.join();
+    workers.clear();
+}
+
+bool ParallelMarker::drain(vector<RVal*>& stack, double budget) {
+    // The threads are only started by the first heap big enough to need
+    // them, small programs never pay for them.
+    if (workers.size() + 1 < deques.size())
+        startWorkers();
+    for (auto obj : stack)
+        deques[0]->push(obj);
+    stack.clear();
+
+    {
+        lock_guard<mutex> l(lock);
+        this->budget = budget;
+        idle = 0;
+        stop = false;
+        finished = 0;
+        ++round;
+    }
+    wake.notify_all();
+
+    work(0, budget);
+
+    {
+        unique_lock<mutex> l(lock);
+        done.wait(l, [this] { return finished == workers.size(); });
+    }
+
+    // All workers are waiting again, the deques can be emptied safely.
+    for (auto & d : deques) {
+        while (RVal* obj = d->pop())
+            stack.push_back(obj);
+        d->releaseRetired();
+    }
+    return stack.empty();
+}
+
+void ParallelMarker::workerMain(unsigned id, unsigned seen) {
+    while (true) {
+        double budget;
+        {
+            unique_lock<mutex> l(lock);
+            wake.wait(l, [this, seen] { return shutdown || round != seen; });
+            if (shutdown)
+                return;
+            seen = round;
+            budget = this->budget;
+        }
+
+        work(id, budget);
+
+        {
+            lock_guard<mutex> l(lock);
+            ++finished;
+        }
+        done.notify_one();
+    }
+}
+
+void ParallelMarker::work(unsigned id, double budget) {
+    auto start = chrono::high_resolution_clock::now();
+    constexpr unsigned checkInterval = 256;
+    MarkDeque& own = *deques[id];
+    unsigned visited = 0;
+
+    while (!stop.load(memory_order_relaxed)) {
+        RVal* obj = own.pop();
+        if (!obj)
+            obj = steal(id);
+
+        if (obj) {
+            forEachSlot(obj, [this, &own] (RVal** slot) {
+                RVal* val = *slot;
+                if (!val || nursery.isYoung(val))
+                    return;
+                // Other threads might race to mark the same object.
+                if (tryMark(nursery, val) && hasPointers(nursery, val))
+                    own.push(val);
+            });
+            // Only worker 0 watches the clock, the others follow its stop.
+            if (id == 0 && ++visited % checkInterval == 0) {
+                chrono::duration<double> t =
+                    chrono::high_resolution_clock::now() - start;
+                if (t.count() > budget)
+                    stop = true;
+            }
+            continue;
+        }
+
+        // Out of work. Idle workers have empty deques and only busy ones
+        // create new work, so once everybody is idle marking is done.
+        idle.fetch_add(1);
+        while (true) {
+            if (idle.load() == deques.size() ||
+                    stop.load(memory_order_relaxed))
+                return;
+            if (hasWork()) {
+                idle.fetch_sub(1);
+                break;
+            }
+            this_thread::yield();
+        }
+    }
+}
+
+RVal* ParallelMarker::steal(unsigned id) {
+    for (unsigned i = 1; i < deques.size(); ++i) {
+        if (RVal* obj = deques[(id + i) % deques.size()]->steal())
+            return obj;
+    }
+    return nullptr;
 }
 
-void GarbageCollector::mark() {
-    // TODO: maybe some mechanism to define static roots?
-    scanStack();
+bool ParallelMarker::hasWork() const {
+    for (auto & d : deques)
+        if (!d->empty())
+            return true;
+    return false;
+}
+
+void Nursery::verify() {
+    for (auto & b : blocks) {
+        assert(b.top <= b.start + blockSize);
+        assert(!b.pinned);
+        b.forEach([&b] (RVal* o) {
+            assert(reinterpret_cast<uintptr_t>(o) < b.top);
+            assert(o->type > Type::Invalid && o->type < Type::End);
+            assert(o->mark == MARKED || o->mark == UNMARKED);
+        });
+    }
+}
+
+constexpr BlockIdx Arena::classBlocks[];
+
+Arena::Arena() {
+    SizeClass c = 0;
+    for (size_t blocks = 0; blocks <= Page::pageSize; ++blocks) {
+        while (classBlocks[c] < blocks)
+            ++c;
+        classOf[blocks] = c;
+    }
+}
+
+void Arena::verify() const {
+    size_t n = 0;
+    for (size_t l = 0; l < numLists; ++l) {
+        auto check = [l] (Page* p) {
+            assert(list(p) == l);
+            assert(pageOf(reinterpret_cast<RVal*>(p->first)) == p);
+            p->verify();
+            p->forEach([p] (RVal* o) {
+                assert(isLeaf(o->type) == p->leaf);
+            });
+        };
+        for (auto p : pages[l])
+            check(p);
+        for (auto p : unswept[l])
+            check(p);
+        n += pages[l].size() + unswept[l].size();
+        for (auto p : available[l]) {
+            assert(list(p) == l);
+            assert(!p->full());
+        }
+    }
+    assert(n == numPages);
+    size_t retained = 0;
+    for (auto const & c : chunks) {
+        Chunk* chunk = c.second;
+        retained += chunk->retained();
+        assert((chunk->retainedPos != Chunk::npos) == (chunk->retained() > 0));
+        assert((chunk->roomPos != Chunk::npos) == !chunk->full());
+    }
+    for (size_t i = 0; i < withRetained.size(); ++i)
+        assert(withRetained[i]->retainedPos == i);
+    for (size_t i = 0; i < withRoom.size(); ++i)
+        assert(withRoom[i]->roomPos == i);
+    assert(retained == retainedPages);
+}
+
+void LargeObjectSpace::verify() const {
+    size_t mapped = 0;
+    for (auto o : objects) {
+        assert(((uintptr_t)o + payloadOffset) % payloadAlign == 0);
+        assert(o->type > Type::Invalid && o->type < Type::End);
+        assert(o->mark == MARKED || o->mark == UNMARKED);
+        assert(header(o)->size > Page::size);
+        mapped += header(o)->mapped;
+    }
+    assert(mapped == allocated);
+}
+
+void PermanentSpace::verify() const {
+    size_t bytes = 0;
+    for (auto o : objects) {
+        assert((uintptr_t)o % Page::blockSize == objOffset);
+        assert(o->mark == MARKED);
+        forEachSlot(o, [this] (RVal** slot) {
+            assert(contains(*slot) && "permanent object points into the heap");
+        });
+        bytes += objSize(o);
+    }
+    assert(bytes == used);
 }
 
 void Page::verify() {
     size_t foundFree = 0;
-    Free* f = freelist.next;
+    Free* f = freelist;
     while (f) {
         auto b = getIndex(f);
-        for (auto i = b; i < b+f->blocks; i++)
-             assert(!objSize[i]);
-        foundFree += f->blocks;
+        assert(b % cellSize == 0);
+        for (auto i = b; i < b+cellSize; i++)
+             assert(!isStart(i));
+        foundFree += cellSize;
         f = f->next;
     }
     assert(foundFree == freeSpace);
 
+    for (size_t w = 0; w < bitmapWords; ++w)
+        assert(!(marks[w] & ~starts[w]));
+
     for (BlockIdx i = 0; i < pageSize; ++i) {
-        if (objSize[i]) {
-            for (auto c = i+1; c < i+objSize[i]; c++)
-                assert(!objSize[c]);
+        if (isStart(i)) {
+            assert(i % cellSize == 0);
             RVal* o __attribute__((unused)) = getAt(i);
             assert(o->type > Type::Invalid && o->type < Type::End);
-            assert(o->mark == MARKED || o->mark == UNMARKED);
+            assert(o->mark == UNMARKED);
         }
     }
 }
@@ -123,26 +1174,8 @@ void Page::verify() {
 // object as well as all objects reachable through it as live.
 extern "C" void __attribute__((noinline)) scanStack_() {
     gc::GarbageCollector& gc = gc::GarbageCollector::inst();
-
     void ** top = (void**)__builtin_frame_address(0);
-    void ** p = top;
-
-#ifdef GC_DEBUG
-    unsigned found = 0;
-#endif
-    while (p < gc.BOTTOM_OF_STACK) {
-        if (*p > (void*)0x1000 && gc.isValidObj(*p)) {
-#ifdef GC_DEBUG
-            found++;
-#endif
-            gc.mark(reinterpret_cast<RVal*>(*p));
-        }
-        p++;
-    }
-
-#ifdef GC_DEBUG
-    printf("scanned %lu slots, found %u objs\n", (p-top)/sizeof(void*), found);
-#endif
+    gc.scanStack(top, gc::GarbageCollector::mutator().stackBase);
 }
 
 
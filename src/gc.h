@@ -1,14 +1,28 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <cstdint>
 #include <cstddef>
 #include <iostream>
 #include <cassert>
+#include <csetjmp>
 #include <cstring>
+#include <limits>
+#include <map>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/mman.h>
 
 #ifndef __GNUG__
 #include <intrin.h>
@@ -25,13 +39,143 @@ namespace gc {
 #ifdef GC_DEBUG
 constexpr static Mark MARKED = 3;
 constexpr static Mark UNMARKED = 7;
+constexpr static Mark FORWARDED = 5;
 #else
 constexpr static Mark MARKED = 1;
 constexpr static Mark UNMARKED = 0;
+constexpr static Mark FORWARDED = 2;
 #endif
 
+// All heap memory lies in one reserved range of address space, so objects
+// can refer to each other by 32 bit offsets from its base, see HeapRef.
+// Memory is mapped into the range when it is taken, and handed back to the
+// OS when it is released.
+class HeapRegion {
+public:
+    static constexpr size_t size = size_t(1) << 32;
+    // Offset 0 stands for null, the first page is never handed out.
+    static constexpr size_t guardBytes = 1 << 12;
+
+    // Start of the range, set before the first object is allocated. It lies
+    // above the first 4GB, so the stack scan never mistakes an immediate for
+    // a heap address.
+    static uintptr_t base;
+
+    // Returns bytes of zeroed memory aligned to align, a power of two.
+    // Throws bad_alloc once the range is used up.
+    static void* take(size_t bytes, size_t align);
+
+    // Hands the memory back to the OS, its part of the range can be taken
+    // again.
+    static void release(void* mem, size_t bytes);
+
+    static bool contains(void const * ptr) {
+        return reinterpret_cast<uintptr_t>(ptr) - base < size;
+    }
+
+    ~HeapRegion() {
+        munmap(reinterpret_cast<void*>(base), size);
+    }
+
+    HeapRegion(HeapRegion const &) = delete;
+    void operator= (HeapRegion const &) = delete;
+
+private:
+    HeapRegion();
+
+    static HeapRegion& inst() {
+        static HeapRegion region;
+        return region;
+    }
+
+    mutex lock;
+    // Unused parts of the range by start address, adjacent ones are merged.
+    map<uintptr_t, size_t> unused;
+};
+
+// A pointer to a heap object stored as offset into the HeapRegion. Fields of
+// objects use it, which halves the size of environments and closures.
+// Immediates are stored as they are, their low 32 bits sign extend to the
+// full value. Offsets of objects are always even.
+template <typename T>
+class HeapRef {
+public:
+    T* get() const {
+        if (offset & 1)
+            return reinterpret_cast<T*>(static_cast<intptr_t>(
+                    static_cast<int32_t>(offset)));
+        return offset ?
+            reinterpret_cast<T*>(HeapRegion::base + offset) : nullptr;
+    }
+
+    operator T* () const {
+        return get();
+    }
+
+    T* operator-> () const {
+        return get();
+    }
+
+    T& operator* () const {
+        return *get();
+    }
+
+    HeapRef& operator= (T* val) {
+        if (isImmediate(val)) {
+            offset = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(val));
+            return *this;
+        }
+        assert(!val || HeapRegion::contains(val));
+        offset = val ? static_cast<uint32_t>(
+                reinterpret_cast<uintptr_t>(val) - HeapRegion::base) : 0;
+        return *this;
+    }
+
+private:
+    uint32_t offset;
+};
+
+// Size in bytes of the object, computed from its header.
+size_t objSize(RVal* obj);
+
+// Objects of these types hold no heap pointers. The arena keeps them in
+// pages of their own, the marker never visits them.
+inline bool isLeaf(Type type) {
+    return type == Type::Double || type == Type::Character ||
+        type == Type::FunctionArgs;
+}
+
+// Counts bytes separately for each object type.
+struct TypeBytes {
+    array<size_t, static_cast<size_t>(Type::End)> bytes{};
+
+    void add(RVal* obj, size_t size) {
+        bytes[static_cast<size_t>(obj->type)] += size;
+    }
+
+    size_t operator[] (Type t) const {
+        return bytes[static_cast<size_t>(t)];
+    }
+
+    size_t total() const {
+        size_t n = 0;
+        for (auto b : bytes)
+            n += b;
+        return n;
+    }
+
+    TypeBytes& operator+= (TypeBytes const & other) {
+        for (size_t t = 0; t < bytes.size(); ++t)
+            bytes[t] += other.bytes[t];
+        return *this;
+    }
+};
+
 typedef uint8_t BlockIdx;
+typedef uint8_t SizeClass;
 
+// A Page holds objects of a single size class. All cells in a page span the
+// same number of blocks, so allocating and freeing is a freelist push/pop.
 class Page {
 public:
     static constexpr size_t blockSize = 32;
@@ -53,47 +197,51 @@ public:
 
     // The memory for objects is partitinoned in addressable blocks
     array<Block, pageSize> block;
-    // The index of the first block of an object is used to store the obj size
-    // in blocks. All subsequent objSize[i] blocks belong to the object at i.
-    array<BlockIdx, pageSize> objSize;
+
+    // Mark bits and object start bits of the page, one per block. They live
+    // in side tables of the chunk, so marking and sweeping do not touch the
+    // objects themselves.
+    static constexpr size_t bitmapWords = 2;
+    static_assert(pageSize <= bitmapWords * 64, "");
+    uint64_t* const marks;
+    uint64_t* const starts;
 
     // Freelist entry.
-    // When a block is unused (ie. objSize[i] == 0) then we store a Free struct
-    // in the block and add it to the freelist linked list.
+    // When a cell is unused (ie. its start bit is clear) then we store a Free
+    // struct in its first block and add it to the freelist linked list.
     struct Free {
-        BlockIdx blocks;
         Free* next;
     };
     static_assert(sizeof(Block) >= sizeof(Free), "");
 
-    // Head of the freelist. The actual entries start at freelist.next and are
-    // placed directly in the pages (using one block to holt one Free
-    // struct).
-    Free freelist;
+    // Head of the freelist. All entries are cellSize blocks long.
+    Free* freelist;
 
     // Total free space in blocks
     size_t freeSpace;
 
-    BlockIdx size2blocks(size_t size) {
+    static BlockIdx size2blocks(size_t size) {
         if (size % blockSize == 0)
             return size / blockSize;
         return 1 + (size / blockSize);
     }
 
-    // This function must be called with a plausible pointer
-    // (ie. block aligned)!
-    // A valid object is:
-    // 1. Within the page boundaries
-    // 2. Pointing to a block in use
-    inline bool isValidObj(void* ptr) const {
-        auto addr = reinterpret_cast<uintptr_t>(ptr);
-        assert((addr & Page::pointerMask) == 0);
+    // Resolves a pointer anywhere into a live cell of this page to the start
+    // of the object in that cell. Returns nullptr for free cells and
+    // pointers into the page metadata.
+    inline RVal* findObj(uintptr_t addr) {
+        if (addr < first || addr >= first + size)
+            return nullptr;
 
-        if (addr < first || addr > last)
-            return false;
+        auto idx = getIndex(reinterpret_cast<void*>(addr));
+        idx -= idx % cellSize;
+        if (!isStart(idx))
+            return nullptr;
+        return getAt(idx);
+    }
 
-        auto idx = getIndex(ptr);
-        return objSize[idx];
+    bool isStart(BlockIdx idx) const {
+        return starts[idx / 64] & (1ull << (idx % 64));
     }
 
     BlockIdx getIndex(void* ptr) const {
@@ -105,23 +253,17 @@ public:
         return idx;
     }
 
-    inline RVal* free2rval(Free* cur, Free* prev, BlockIdx sz) {
-        auto idx = getIndex(cur);
-        if (cur->blocks > sz) {
-            // In case not all blocks are needed we create a new
-            // freelist entry with the remaining blocks.
-            Free* next = reinterpret_cast<Free*>(getAt(idx+sz));
-            next->blocks = cur->blocks - sz;
-            next->next = cur->next;
-            prev->next = next;
-            freeSpace -= sz;
-        } else {
-            prev->next = cur->next;
-            freeSpace -= cur->blocks;
-        }
+    // Pops a cell from the freelist. Returns nullptr if the page is full.
+    inline RVal* alloc() {
+        Free* cur = freelist;
+        if (!cur)
+            return nullptr;
+        freelist = cur->next;
+        freeSpace -= cellSize;
 
-        assert(!objSize[idx]);
-        objSize[idx] = sz;
+        auto idx = getIndex(cur);
+        assert(!isStart(idx));
+        starts[idx / 64] |= 1ull << (idx % 64);
 
         RVal* obj = getAt(idx);
         obj->mark = UNMARKED;
@@ -129,61 +271,48 @@ public:
         return obj;
     }
 
-    inline RVal* alloc(size_t size) {
-        if (!freelist.next)
-            return nullptr;
-
-        size_t needed = size2blocks(size);
-
-        Free* prev = &freelist;
-        Free* cur = freelist.next;
-
-        // Search for the first node on the freelist which has enough blocks
-        // available.
-        while (cur) {
-            if (cur->blocks >= needed)
-                return free2rval(cur, prev, needed);
-            prev = cur;
-            cur = cur->next;
-        }
-        return nullptr;
-    }
-
-    Page(uint8_t* store)
-          : store(store),
+    Page(SizeClass sizeClass, BlockIdx cellSize, bool leaf,
+         uint64_t* marks, uint64_t* starts)
+          : marks(marks),
+            starts(starts),
             first(reinterpret_cast<uintptr_t>(&block[0])),
-            last(reinterpret_cast<uintptr_t>(&block[pageSize - 1])) {
+            last(reinterpret_cast<uintptr_t>(&block[pageSize - 1])),
+            sizeClass(sizeClass),
+            cellSize(cellSize),
+            leaf(leaf) {
 
         // Some sanity checks. Page must be aligned
         assert(((uintptr_t)&block[3] & pointerMask) == 0);
         assert(getIndex(&block[3]) == 3);
+        assert(pageSize % cellSize == 0);
 
-        objSize.fill(0);
+        memset(marks, 0, bitmapWords * sizeof(uint64_t));
+        memset(starts, 0, bitmapWords * sizeof(uint64_t));
         memset(&block[0], 0, size);
 
-        Free* first = (Free*)getAt(0);
-        first->next = nullptr;
-        first->blocks = pageSize;
-        freelist.next = first;
-
         freeSpace = pageSize;
+        rebuildFreelist();
     }
 
-    void sweep() {
-        BlockIdx i = 0;
-        while (i < pageSize) {
-            auto sz = objSize[i];
-            if (sz == 0) {
-                ++i;
-                continue;
+    // Works on whole bitmap words: objects which start in a block but are
+    // not marked are dead. Afterwards all mark bits are clear. Only the
+    // headers of dead objects are read, to count them in freed.
+    void sweep(TypeBytes & freed) {
+        bool died = false;
+        for (size_t w = 0; w < bitmapWords; ++w) {
+            uint64_t dead = starts[w] & ~marks[w];
+            starts[w] &= marks[w];
+            marks[w] = 0;
+            died = died || dead;
+            while (dead) {
+                BlockIdx idx = w * 64 + __builtin_ctzll(dead);
+                freed.add(getAt(idx), objSize(getAt(idx)));
+                freeBlock(idx);
+                dead &= dead - 1;
             }
-
-            if (getAt(i)->mark == UNMARKED)
-                freeBlock(i);
-
-            getAt(i)->mark = UNMARKED;
-            i += sz;
         }
+        if (died)
+            rebuildFreelist();
     }
 
     size_t free() const {
@@ -196,35 +325,99 @@ public:
         return freeSpace == pageSize;
     }
 
+    bool full() const {
+        return freelist == nullptr;
+    }
+
+    // Number of cells in the page.
+    size_t capacity() const {
+        return pageSize / cellSize;
+    }
+
+    // Number of objects, only meaningful once the page is swept.
+    size_t liveCells() const {
+        return popcount(starts);
+    }
+
+    // Number of objects which survive the next sweep.
+    size_t markedCells() const {
+        return popcount(marks);
+    }
+
+    // Bytes taken by the objects of the page. Before the page is swept
+    // only marked objects count.
+    size_t liveBytes(bool swept) {
+        size_t n = 0;
+        for (size_t w = 0; w < bitmapWords; ++w) {
+            uint64_t bits = swept ? starts[w] : starts[w] & marks[w];
+            while (bits) {
+                n += objSize(getAt(w * 64 + __builtin_ctzll(bits)));
+                bits &= bits - 1;
+            }
+        }
+        return n;
+    }
+
+    // Calls f for every object in the page.
+    template <typename F>
+    void forEach(F f) {
+        for (size_t w = 0; w < bitmapWords; ++w) {
+            uint64_t bits = starts[w];
+            while (bits) {
+                f(getAt(w * 64 + __builtin_ctzll(bits)));
+                bits &= bits - 1;
+            }
+        }
+    }
+
     Page(Page const &) = delete;
     void operator= (Page const &) = delete;
 
-    // Address of the memory base of this page. Use this to free the page!
-    uint8_t* store;
-
     // Address of the first and last block.
     const uintptr_t first, last;
 
+    // The size class this page serves and the number of blocks per cell.
+    const SizeClass sizeClass;
+    const BlockIdx cellSize;
+    // Set if the objects of the page hold no heap pointers, see isLeaf().
+    const bool leaf;
+
+    // Set while an object of the page is referenced from the C stack. Its
+    // objects cannot be moved then.
+    bool pinned = false;
+
 private:
-    // Freeing an object
+    static size_t popcount(uint64_t const* bitmap) {
+        size_t n = 0;
+        for (size_t w = 0; w < bitmapWords; ++w)
+            n += __builtin_popcountll(bitmap[w]);
+        return n;
+    }
+
+    // Freeing an object, its cell is put on the freelist by
+    // rebuildFreelist().
     void freeBlock(BlockIdx idx) {
         // TODO destructor??
 
-        BlockIdx sz = objSize[idx];
-
 #ifdef GC_DEBUG
-        RVal* old = getAt(idx);
-        assert(old->mark == UNMARKED);
-        memset(old, 0xd, sz * blockSize);
+        memset(getAt(idx), 0xd, cellSize * blockSize);
 #endif
-        freeSpace += sz;
-
-        Free* f = reinterpret_cast<Free*>(getAt(idx));
-        f->next = freelist.next;
-        f->blocks = sz;
-        freelist.next = f;
+        assert(idx % cellSize == 0);
+        freeSpace += cellSize;
+    }
 
-        objSize[idx] = 0;
+    // Threads the freelist through all free cells, lowest address first.
+    // The page then fills up from its start, which keeps the live objects
+    // of a page together.
+    void rebuildFreelist() {
+        freelist = nullptr;
+        for (BlockIdx i = pageSize; i > 0; i -= cellSize) {
+            if (isStart(i - cellSize))
+                continue;
+            Free* f = reinterpret_cast<Free*>(getAt(i - cellSize));
+            f->next = freelist;
+            freelist = f;
+        }
     }
 
     RVal* getAt(BlockIdx idx) {
@@ -233,242 +426,2199 @@ private:
 };
 
 
-class Arena {
+// Pages are carved out of big chunks which are aligned to their size.
+// Masking an address gives its chunk, and the page table of the chunk gives
+// the Page containing it. Chunks are mapped from the OS, memory of their
+// free pages is kept around for reuse or handed back with decommit().
+class Chunk {
 public:
-    static constexpr size_t pageBufferSize = sizeof(Page) +
-                                             2 * sizeof(Page::blockSize);
-
-    // The target is to allocate a Page which spans one physical pages
-    // Given the block size of 32 this will result in a bit less than 250
-    // blocks per Page which makes good use of the BlockSize (uint8_t) objSize
-    // map.
-    static_assert(pageBufferSize <= 4096, "");
-    static_assert(pageBufferSize > 0.98*4096, "");
-
-    // Allocate an RVal of size sz in bytes. If grow is true we are allowed to
-    // grow the arena (ie. allocate a new page).
-    RVal* alloc(size_t sz, bool grow) {
-        for (auto p : pageList) {
-            if (p->free() < sz)
-                continue;
-            auto res = p->alloc(sz);
-            if (res)
-                return res;
-        }
-
-        if (pageList.size() > 0 && !grow)
-            return nullptr;
+    static constexpr size_t chunkBits = 20;
+    static constexpr size_t size = 1 << chunkBits;
+    static constexpr size_t pageBits = 12;
+    static constexpr size_t pageBytes = 1 << pageBits;
+    static constexpr size_t pagesPerChunk = size / pageBytes;
+
+    // The first pages of a chunk hold its side tables, with one bit per
+    // block of the chunk: the mark bits, then the object start bits.
+    static constexpr size_t bitmapBytes = size / Page::blockSize / 8;
+    static constexpr size_t reservedPages = 2 * bitmapBytes / pageBytes;
+    static_assert(pageBytes / Page::blockSize == Page::bitmapWords * 64, "");
+
+    static uintptr_t index(uintptr_t addr) {
+        return addr >> chunkBits;
+    }
 
-        // Allocate a new page. Page must be block aligned.
-        uint8_t* store = new uint8_t[pageBufferSize];
-        uintptr_t pn = reinterpret_cast<uintptr_t>(store);
-        uintptr_t aligned = (pn + Page::blockSize - 1) & - Page::blockSize;
-        void* place = reinterpret_cast<void*>(aligned);
-        assert(place >= store &&
-                reinterpret_cast<uintptr_t>(store) + pageBufferSize >= 
-                reinterpret_cast<uintptr_t>(place) + sizeof(Page));
-        auto p = new (place) Page(store);
-        registerPage(p);
-
-        auto n = p->alloc(sz);
-        if (!n) throw bad_alloc();
-        return n;
+    // The mark bitmap word of the block at addr, and the bit in it.
+    static uint64_t* markWord(uintptr_t addr) {
+        return reinterpret_cast<uint64_t*>(addr & ~(size - 1)) +
+            bit(addr) / 64;
     }
 
-    inline bool isValidObj(void* ptr) const {
-        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    static uint64_t* startWord(uintptr_t addr) {
+        return markWord(addr) + bitmapBytes / sizeof(uint64_t);
+    }
 
-        // quickly discard implausible pointers
-        if ((addr & Page::pointerMask) != 0)
-            return false;
+    static uint64_t markBit(uintptr_t addr) {
+        return 1ull << (bit(addr) % 64);
+    }
 
-        assert(minAddr < maxAddr);
+    Page* page(uintptr_t addr) const {
+        return pages[slot(addr)];
+    }
 
-        // discard pointers outside allocated space
-        if (addr < minAddr || addr > maxAddr)
-            return false;
+    // Returns memory for a new page, a free page which is still backed by
+    // memory if there is one. The chunk must not be full.
+    void* claim() {
+        assert(!full());
+        auto & from = freeSlots.empty() ? unbacked : freeSlots;
+        unsigned s = from.back();
+        from.pop_back();
+        return reinterpret_cast<void*>(base + s * pageBytes);
+    }
 
-        for (auto p : pageList) {
-            if (p->isValidObj(ptr)) {
-                return true;
-            }
-        }
+    void registerPage(Page* p) {
+        assert(!pages[slot(p->first)]);
+        pages[slot(p->first)] = p;
+    }
 
-        return false;
+    void release(Page* p) {
+        unsigned s = slot(p->first);
+        assert(pages[s] == p);
+        pages[s] = nullptr;
+        freeSlots.push_back(s);
     }
 
-    void sweep() {
-        for (auto pi = pageList.begin(); pi != pageList.end(); ) {
-            auto p = *pi;
-            p->sweep();
-            // If a page is completely empty we release it
-            if (p->empty()) {
-#ifdef GC_DEBUG
-                cout << "Released a Page\n";
-#endif
-                delete [] p->store;
-                pi = pageList.erase(pi);
-            } else {
-                pi++;
-            }
-        }
+    // Returns the memory of the most recently released page to the OS. It
+    // reads as zeros once it is touched again.
+    void decommit() {
+        assert(retained() > 0);
+        unsigned s = freeSlots.back();
+        freeSlots.pop_back();
+        madvise(reinterpret_cast<void*>(base + s * pageBytes), pageBytes,
+                MADV_DONTNEED);
+        unbacked.push_back(s);
     }
 
-    size_t free() const {
-        size_t f = 0;
-        for (auto p : pageList)
-            f += p->free();
-        return f;
+    // Number of free pages which still hold memory.
+    size_t retained() const {
+        return freeSlots.size();
     }
 
-    size_t size() const {
-        return pageList.size() * Page::size;
+    bool full() const {
+        return freeSlots.empty() && unbacked.empty();
     }
 
-    void verify() const {
-        for (auto p : pageList)
-            p->verify();
+    bool empty() const {
+        return freeSlots.size() + unbacked.size() ==
+            pagesPerChunk - reservedPages;
     }
 
-    Arena() : minAddr(-1), maxAddr(0) {}
+    Chunk() {
+        // The OS backs pages only once they are touched.
+        base = reinterpret_cast<uintptr_t>(HeapRegion::take(size, size));
+        pages.fill(nullptr);
+        // Hand out the lowest slots first
+        for (unsigned s = pagesPerChunk; s > reservedPages; --s)
+            unbacked.push_back(s - 1);
+    }
 
-    ~Arena() {
-        for (auto p : pageList) {
-            delete [] p->store;
-        }
-        pageList.clear();
+    ~Chunk() {
+        HeapRegion::release(reinterpret_cast<void*>(base), size);
     }
 
-    Arena(Arena const &) = delete;
-    void operator= (Arena const &) = delete;
+    Chunk(Chunk const &) = delete;
+    void operator= (Chunk const &) = delete;
+
+    uintptr_t base;
 
-    deque<Page*> pageList;
+    // Positions of the chunk in the lists of the Arena which hold chunks
+    // with retained pages and chunks which are not full, npos if absent.
+    static constexpr size_t npos = SIZE_MAX;
+    size_t retainedPos = npos;
+    size_t roomPos = npos;
 
 private:
-    void registerPage(Page * p) {
-#ifdef GC_DEBUG
-      cout << "Allocated a new Page\n";
-#endif
-        // TODO: we never update the boundaries if we remove a page
-        pageList.push_front(p);
-        if (p->first < minAddr)
-            minAddr = p->first;
-        if (p->last > maxAddr)
-            maxAddr = p->last;
+    static unsigned slot(uintptr_t addr) {
+        return (addr >> pageBits) & (pagesPerChunk - 1);
+    }
+
+    static size_t bit(uintptr_t addr) {
+        return (addr & (size - 1)) >> Page::blockBits;
     }
 
-    uintptr_t minAddr, maxAddr;
+    array<Page*, pagesPerChunk> pages;
+    // Free slots whose memory is resident, and those which are not.
+    vector<unsigned> freeSlots;
+    vector<unsigned> unbacked;
 };
 
 
-class GarbageCollector {
+class Arena {
 public:
-    // Interface to request memory from the GC
-    static RVal* alloc(size_t sz, Type type) {
-        return inst().doAlloc(sz, type);
+    // The target is a Page which spans one physical page. Given the block
+    // size of 32 this results in 120 blocks per Page, the rest holds the
+    // page header.
+    static_assert(sizeof(Page) <= Chunk::pageBytes, "");
+    static_assert(Page::size > 0.93*Chunk::pageBytes, "");
+
+    // Cell sizes in blocks. Each one divides Page::pageSize, so no page
+    // has a wasted tail. Up to 40 blocks rounding up wastes less than 25%
+    // of a cell. The two largest classes waste more, an object of 41 blocks
+    // leaves 19 of its 60 unused and one of 61 blocks almost half a page,
+    // but objects above 1280 bytes are rare: long vectors mostly.
+    static constexpr SizeClass numClasses = 16;
+    static constexpr BlockIdx classBlocks[numClasses] =
+        {1, 2, 3, 4, 5, 6, 8, 10, 12, 15, 20, 24, 30, 40, 60, 120};
+    static_assert(classBlocks[numClasses - 1] == Page::pageSize, "");
+
+    // Leaf objects and objects with pointers never share a page. Each size
+    // class has a list of pages for either kind.
+    static constexpr size_t numLists = 2 * numClasses;
+
+    static size_t list(SizeClass c, bool leaf) {
+        return leaf ? numClasses + c : c;
     }
 
-private:
-    // Currently we have just one arena. A possible optimization would be to
-    // have different arenas for different size buckets.
-    Arena arena;
+    static size_t list(Page const * p) {
+        return list(p->sizeClass, p->leaf);
+    }
 
-    constexpr static size_t INITIAL_HEAP_SIZE = 4*Page::size;
-    constexpr static size_t MIN_HEAP_SIZE = 4*Page::size;
-    static_assert (INITIAL_HEAP_SIZE >= MIN_HEAP_SIZE, "");
+    // Pages start at the beginning of their memory page, so the page of an
+    // arena object is found without a table lookup.
+    static Page* pageOf(RVal* obj) {
+        return reinterpret_cast<Page*>(
+                reinterpret_cast<uintptr_t>(obj) & ~(Chunk::pageBytes - 1));
+    }
 
-    size_t heapLimit = INITIAL_HEAP_SIZE;
-    constexpr static double HEAP_MIN_FREE = 0.1f;
-    constexpr static double HEAP_MAX_FREE = 0.4f;
-    constexpr static double HEAP_GROW_RATIO = 1.2f;
-    constexpr static double HEAP_SHRINK_RATIO = 0.8f;
+    // Allocate an RVal of size sz in bytes, in a leaf page if leaf is set. If
+    // grow is true we are allowed to grow the arena (ie. allocate a new
+    // page).
+    RVal* alloc(size_t sz, bool leaf, bool grow) {
+        assert(sz <= Page::size);
+        SizeClass c = classOf[Page::size2blocks(sz)];
+        size_t l = list(c, leaf);
+
+        // Any page on the available list has at least one free cell.
+        auto & avail = available[l];
+        if (avail.empty())
+            sweepList(l);
+        if (!avail.empty()) {
+            Page* p = avail.back();
+            RVal* res = p->alloc();
+            assert(res);
+            if (p->full())
+                avail.pop_back();
+            return res;
+        }
 
-    RVal* doAlloc(size_t sz, Type type) {
-        RVal* res = arena.alloc(sz, arena.size() < heapLimit);
+        if (numPages > 0 && !grow)
+            return nullptr;
 
-        //  Allocation failed
-        if (!res) {
-            doGc();
-
-            if ((float)free() / (float)size() < HEAP_MIN_FREE) {
-                heapLimit *= HEAP_GROW_RATIO;
-            } else if ((float)free() / (float)size() > HEAP_MAX_FREE &&
-                    heapLimit > MIN_HEAP_SIZE) {
-                heapLimit *= HEAP_SHRINK_RATIO;
-                heapLimit =
-                    heapLimit < MIN_HEAP_SIZE ? MIN_HEAP_SIZE : heapLimit;
+        auto p = newPage(c, leaf);
+
+        auto n = p->alloc();
+        if (!n) throw bad_alloc();
+        if (!p->full())
+            avail.push_back(p);
+        return n;
+    }
+
+    // Finds the object containing addr, if it is a live object in the arena.
+    // This is a chunk table lookup followed by an index into the page table
+    // of the chunk, so it does not depend on the number of pages.
+    inline RVal* findObj(void* ptr) const {
+        Page* p = findPage(ptr);
+        if (!p)
+            return nullptr;
+        return p->findObj(reinterpret_cast<uintptr_t>(ptr));
+    }
+
+    // Keeps the objects of the page ptr points into from being evacuated.
+    void pin(void* ptr) {
+        if (Page* p = findPage(ptr))
+            p->pinned = true;
+    }
+
+    // Compaction is worth it if packing the live objects densely would free
+    // at least this many pages, and at least this fraction of the arena.
+    static constexpr size_t compactMinPages = 8;
+    static constexpr double compactMinRatio = 0.25;
+
+    // Called after marking, before sweeping. Pages without any live object
+    // are released by the sweep anyway, only the partly used ones count.
+    bool fragmented() const {
+        size_t spare = 0;
+        for (size_t l = 0; l < numLists; ++l) {
+            size_t live = 0, used = 0;
+            for (auto p : pages[l]) {
+                size_t marked = p->markedCells();
+                live += marked;
+                if (marked)
+                    ++used;
+            }
+            size_t perPage = Page::pageSize / classBlocks[l % numClasses];
+            spare += used - (live + perPage - 1) / perPage;
+        }
+        return spare >= compactMinPages && spare >= compactMinRatio * numPages;
+    }
+
+    // Picks the pages to evacuate, the arena must be swept. In each list of
+    // pages the sparsest ones are taken, as long as their objects still fit
+    // into the free cells of the remaining pages. Pinned pages and pages
+    // which are more than half full stay. The picked pages are withdrawn
+    // from the allocator, and the remaining ones are handed out densest
+    // first. Returns false if no page was picked.
+    bool selectEvacuation() {
+        assert(!sweeping());
+        assert(evacuating.empty());
+        for (size_t l = 0; l < numLists; ++l) {
+            auto & ps = pages[l];
+            sort(ps.begin(), ps.end(), [] (Page* a, Page* b) {
+                return a->liveCells() < b->liveCells();
+            });
+
+            size_t free = 0;
+            for (auto p : ps)
+                free += p->capacity() - p->liveCells();
+
+            vector<Page*> stay;
+            size_t moved = 0;
+            for (auto p : ps) {
+                size_t live = p->liveCells();
+                size_t cap = p->capacity();
+                // free includes the free cells of p itself.
+                if (!p->pinned && live * 2 <= cap &&
+                        moved + live <= free - (cap - live)) {
+                    evacuating.push_back(p);
+                    moved += live;
+                    free -= cap - live;
+                } else {
+                    stay.push_back(p);
+                }
             }
 
-            res = arena.alloc(sz, true);
+            if (stay.size() == ps.size())
+                continue;
+            ps.swap(stay);
+            available[l].clear();
+            for (auto p : ps)
+                if (!p->full())
+                    available[l].push_back(p);
         }
+        return !evacuating.empty();
+    }
 
-        // TODO: add a backup allocator for huge objects. Currently allocations
-        // bigger than Page::size will fail.
-        if (!res) throw bad_alloc();
+    // Calls f for every object in a page picked for evacuation.
+    template <typename F>
+    void forEachEvacuated(F f) {
+        for (auto p : evacuating)
+            p->forEach(f);
+    }
 
-        res->type = type;
-        return res;
-    };
+    // Calls f for every object with pointers outside of the evacuated
+    // pages.
+    template <typename F>
+    void forEachPointerObject(F f) {
+        for (size_t l = 0; l < numClasses; ++l)
+            for (auto p : pages[list(l, false)])
+                p->forEach(f);
+    }
 
-    size_t size() const {
-        return arena.size();
+    // All objects of the evacuated pages were moved, their memory is
+    // released. Pins only last for one compaction.
+    void finishEvacuation() {
+        for (auto p : evacuating) {
+#ifdef GC_DEBUG
+            memset(&p->block[0], 0xd, Page::size);
+#endif
+            releasePage(p);
+        }
+        evacuating.clear();
+        for (auto & ps : pages)
+            for (auto p : ps)
+                p->pinned = false;
+    }
+
+    // Called after marking. Pages are not swept right away, instead they
+    // are queued and swept when the allocator needs a cell of their size
+    // class, or by sweepSome. Until then their unmarked objects are dead but
+    // still occupy their cells.
+    void startSweep() {
+        for (size_t l = 0; l < numLists; ++l) {
+            assert(unswept[l].empty());
+            unswept[l].swap(pages[l]);
+            available[l].clear();
+        }
+    }
+
+    // Sweeps up to n pages. Returns true if no unswept pages are left.
+    bool sweepSome(size_t n) {
+        for (size_t l = 0; l < numLists; ++l) {
+            while (!unswept[l].empty()) {
+                if (n-- == 0)
+                    return false;
+                sweepPage(unswept[l].back());
+                unswept[l].pop_back();
+            }
+        }
+        return true;
+    }
+
+    // Has to be called before the next marking starts, otherwise mark
+    // bits of unswept pages would be mixed up with the new ones.
+    void finishSweep() {
+        sweepSome(numeric_limits<size_t>::max());
+    }
+
+    // Bytes of the objects released by sweeping.
+    TypeBytes const & freedBytes() const {
+        return freed;
+    }
+
+    bool sweeping() const {
+        for (auto & pending : unswept)
+            if (!pending.empty())
+                return true;
+        return false;
     }
 
     size_t free() const {
-        return arena.free();
+        size_t f = 0;
+        for (size_t l = 0; l < numLists; ++l) {
+            for (auto p : pages[l])
+                f += p->free();
+            for (auto p : unswept[l])
+                f += p->free();
+        }
+        return f;
+    }
+
+    size_t size() const {
+        return numPages * Page::size;
     }
 
-    const void * BOTTOM_OF_STACK;
+    size_t pageCount() const {
+        return numPages;
+    }
 
-    void scanStack();
-    void mark();
+    size_t leafPageCount() const {
+        size_t n = 0;
+        for (SizeClass c = 0; c < numClasses; ++c)
+            n += pages[list(c, true)].size() + unswept[list(c, true)].size();
+        return n;
+    }
 
-    void doGc();
+    // Occupancy of the pages of one size class, of both kinds.
+    struct ClassStats {
+        size_t pages = 0;
+        // Cells in those pages, and the ones holding live objects.
+        size_t cells = 0;
+        size_t liveCells = 0;
+        // Bytes taken by the live objects.
+        size_t liveBytes = 0;
+    };
 
-    inline bool isValidObj(void* ptr) const {
-        return arena.isValidObj(ptr);
+    static constexpr size_t cellBytes(SizeClass c) {
+        return classBlocks[c] * Page::blockSize;
     }
 
-    void mark(RVal* val) {
-#ifdef GC_DEBUG 
-        assert(isValidObj(val));
-#endif
-        if (val->mark == MARKED)
-            return;
-        assert(val->mark == UNMARKED);
-        val->mark = MARKED;
-        visitChildren(val);
+    // Pages waiting to be swept count their marked objects as live.
+    array<ClassStats, numClasses> classStats() const {
+        array<ClassStats, numClasses> res;
+        for (size_t l = 0; l < numLists; ++l) {
+            auto count = [&res] (Page* p, bool swept) {
+                ClassStats& s = res[p->sizeClass];
+                s.pages++;
+                s.cells += p->capacity();
+                s.liveCells += swept ? p->liveCells() : p->markedCells();
+                s.liveBytes += p->liveBytes(swept);
+            };
+            for (auto p : pages[l])
+                count(p, true);
+            for (auto p : unswept[l])
+                count(p, false);
+        }
+        return res;
     }
 
-    void visitChildren(RVal*);
+    // Free pages which are kept mapped for reuse.
+    size_t retainedCount() const {
+        return retainedPages;
+    }
 
-    // Delete everything which is not reachable anymore
-    void sweep() {
-        arena.sweep();
+    // Memory of free pages above limit bytes is returned to the OS.
+    void setRetainLimit(size_t limit) {
+        retainLimit = limit;
     }
 
-    void verify() const {
-        arena.verify();
+    void verify() const;
+
+    Arena();
+
+    ~Arena() {
+        for (auto const & c : chunks)
+            delete c.second;
     }
 
-    static GarbageCollector & inst() {
-        static GarbageCollector gc;
-        return gc;
+    Arena(Arena const &) = delete;
+    void operator= (Arena const &) = delete;
+
+private:
+    Page* findPage(void* ptr) const {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+
+        auto ci = chunks.find(Chunk::index(addr));
+        if (ci == chunks.end())
+            return nullptr;
+        return ci->second->page(addr);
     }
 
-    // TODO: setting the BOTTOM_OF_STACK here is a bit brittle, as we just
-    // assume that the site of the first allocation is the earliest call frame
-    // holding live objects.
-#ifdef __GNUG__
-    GarbageCollector() : BOTTOM_OF_STACK(__builtin_frame_address(0)) { }
-#else
-    GarbageCollector() : BOTTOM_OF_STACK(_AddressOfReturnAddress()) {}
+    // Sweeps pages of list l until one of them has a free cell.
+    void sweepList(size_t l) {
+        auto & pending = unswept[l];
+        while (!pending.empty() && available[l].empty()) {
+            sweepPage(pending.back());
+            pending.pop_back();
+        }
+    }
+
+    // Empty pages are released, the others go back to their list.
+    void sweepPage(Page* p) {
+        p->sweep(freed);
+        if (p->empty()) {
+#ifdef GC_DEBUG
+            cout << "Released a Page\n";
 #endif
+            releasePage(p);
+        } else {
+            pages[list(p)].push_back(p);
+            if (!p->full())
+                available[list(p)].push_back(p);
+        }
+    }
 
-    GarbageCollector(GarbageCollector const &) = delete;
-    void operator=(GarbageCollector const &) = delete;
-    friend void ::scanStack_();
-};
+    Page* newPage(SizeClass c, bool leaf) {
+#ifdef GC_DEBUG
+      cout << "Allocated a new Page\n";
+#endif
+        // Reuse retained pages before touching new memory.
+        Chunk* chunk;
+        if (!withRetained.empty()) {
+            chunk = withRetained.back();
+        } else if (!withRoom.empty()) {
+            chunk = withRoom.back();
+        } else {
+            chunk = new Chunk();
+            chunks[Chunk::index(chunk->base)] = chunk;
+        }
+        if (chunk->retained())
+            --retainedPages;
+
+        uintptr_t mem = reinterpret_cast<uintptr_t>(chunk->claim());
+        track(chunk);
+        auto p = new (reinterpret_cast<void*>(mem)) Page(c, classBlocks[c],
+                leaf, Chunk::markWord(mem), Chunk::startWord(mem));
+        chunk->registerPage(p);
+        pages[list(c, leaf)].push_back(p);
+        ++numPages;
+        return p;
+    }
 
-} // namespace gc
+    void releasePage(Page* p) {
+        auto ci = chunks.find(Chunk::index(p->first));
+        assert(ci != chunks.end());
+        Chunk* chunk = ci->second;
+        chunk->release(p);
+        --numPages;
+        if (++retainedPages * Chunk::pageBytes > retainLimit) {
+            chunk->decommit();
+            --retainedPages;
+        }
+        // Keep the last chunk around, a program with a tiny heap would map
+        // and unmap it all the time otherwise.
+        if (chunk->empty() && chunks.size() > 1) {
+            retainedPages -= chunk->retained();
+            unlist(withRetained, chunk, &Chunk::retainedPos);
+            unlist(withRoom, chunk, &Chunk::roomPos);
+            chunks.erase(ci);
+            delete chunk;
+        } else {
+            track(chunk);
+        }
+    }
 
+    // Puts the chunk on the lists its state calls for, in O(1).
+    void track(Chunk* chunk) {
+        if (chunk->retained())
+            enlist(withRetained, chunk, &Chunk::retainedPos);
+        else
+            unlist(withRetained, chunk, &Chunk::retainedPos);
+        if (!chunk->full())
+            enlist(withRoom, chunk, &Chunk::roomPos);
+        else
+            unlist(withRoom, chunk, &Chunk::roomPos);
+    }
+
+    static void enlist(vector<Chunk*> & l, Chunk* chunk,
+            size_t Chunk::* pos) {
+        if (chunk->*pos != Chunk::npos)
+            return;
+        chunk->*pos = l.size();
+        l.push_back(chunk);
+    }
+
+    // Swaps the last chunk of the list into the place of the removed one.
+    static void unlist(vector<Chunk*> & l, Chunk* chunk,
+            size_t Chunk::* pos) {
+        size_t i = chunk->*pos;
+        if (i == Chunk::npos)
+            return;
+        assert(l[i] == chunk);
+        l[i] = l.back();
+        l[i]->*pos = i;
+        l.pop_back();
+        chunk->*pos = Chunk::npos;
+    }
+
+    // All chunks, indexed by their base address shifted by Chunk::chunkBits.
+    unordered_map<uintptr_t, Chunk*> chunks;
+    // Chunks with retained pages, and chunks which are not full.
+    vector<Chunk*> withRetained;
+    vector<Chunk*> withRoom;
+
+    // Swept pages of each list.
+    array<vector<Page*>, numLists> pages;
+    // Pages of each list waiting to be swept.
+    array<vector<Page*>, numLists> unswept;
+    // Swept pages of each list which still have free cells.
+    array<vector<Page*>, numLists> available;
+    // Pages whose objects are being moved by a compaction.
+    vector<Page*> evacuating;
+    size_t numPages = 0;
+    size_t retainedPages = 0;
+    size_t retainLimit = 1 << 20;
+    TypeBytes freed;
+
+    // Maps an object size in blocks to the smallest class which fits it.
+    array<SizeClass, Page::pageSize + 1> classOf;
+};
+
+
+// Objects which do not fit into a Page get their own anonymous mapping, which
+// is unmapped as soon as the object dies.
+class LargeObjectSpace {
+public:
+    // Vector payloads start right after the header of the vector, we place
+    // the object such that the payload is aligned for SIMD loads.
+    static constexpr size_t payloadAlign = 64;
+    static constexpr size_t payloadOffset = 8;
+
+    // Bookkeeping stored at the start of each mapping, in front of the
+    // object.
+    struct Header {
+        size_t mapped;
+        size_t size;
+    };
+    static constexpr size_t objOffset = payloadAlign - payloadOffset;
+    static_assert(sizeof(Header) <= objOffset, "");
+    // Large objects are never aligned to a block, which tells them apart
+    // from arena objects.
+    static_assert(objOffset % Page::blockSize != 0, "");
+
+    RVal* alloc(size_t sz) {
+        size_t mapped = (objOffset + sz + Chunk::pageBytes - 1) &
+                        ~(Chunk::pageBytes - 1);
+        void* store = HeapRegion::take(mapped, Chunk::pageBytes);
+
+        Header* h = reinterpret_cast<Header*>(store);
+        h->mapped = mapped;
+        h->size = sz;
+
+        RVal* obj = reinterpret_cast<RVal*>(
+                reinterpret_cast<uint8_t*>(store) + objOffset);
+        obj->mark = UNMARKED;
+        objects.insert(obj);
+        for (size_t o = 0; o < mapped; o += Chunk::pageBytes)
+            pages[(reinterpret_cast<uintptr_t>(store) + o) >> pageBits] = obj;
+        allocated += mapped;
+#ifdef GC_DEBUG
+        cout << "Mapped a large object of " << sz << "b\n";
+#endif
+        return obj;
+    }
+
+    // Resolves any pointer into a large object to its start.
+    inline RVal* findObj(void* ptr) const {
+        auto pi = pages.find(reinterpret_cast<uintptr_t>(ptr) >> pageBits);
+        if (pi == pages.end())
+            return nullptr;
+        RVal* obj = pi->second;
+        auto start = reinterpret_cast<uint8_t*>(obj);
+        if (ptr < start || ptr >= start + header(obj)->size)
+            return nullptr;
+        return obj;
+    }
+
+    void sweep() {
+        for (auto oi = objects.begin(); oi != objects.end(); ) {
+            RVal* obj = *oi;
+            if (obj->mark == UNMARKED) {
+                Header* h = header(obj);
+                freed.add(obj, h->size);
+                allocated -= h->mapped;
+                for (size_t o = 0; o < h->mapped; o += Chunk::pageBytes)
+                    pages.erase((reinterpret_cast<uintptr_t>(h) + o) >> pageBits);
+                HeapRegion::release(h, h->mapped);
+                oi = objects.erase(oi);
+            } else {
+                obj->mark = UNMARKED;
+                oi++;
+            }
+        }
+    }
+
+    // Total bytes mapped for large objects.
+    size_t size() const {
+        return allocated;
+    }
+
+    size_t count() const {
+        return objects.size();
+    }
+
+    TypeBytes const & freedBytes() const {
+        return freed;
+    }
+
+    template <typename F>
+    void forEach(F f) {
+        for (auto obj : objects)
+            f(obj);
+    }
+
+    void verify() const;
+
+    LargeObjectSpace() {}
+
+    ~LargeObjectSpace() {
+        for (auto obj : objects) {
+            Header* h = header(obj);
+            HeapRegion::release(h, h->mapped);
+        }
+    }
+
+    LargeObjectSpace(LargeObjectSpace const &) = delete;
+    void operator= (LargeObjectSpace const &) = delete;
+
+private:
+    static Header* header(RVal* obj) {
+        return reinterpret_cast<Header*>(
+                reinterpret_cast<uint8_t*>(obj) - objOffset);
+    }
+
+    static constexpr size_t pageBits = Chunk::pageBits;
+
+    unordered_set<RVal*> objects;
+    // Maps every page spanned by a large object to the object.
+    unordered_map<uintptr_t, RVal*> pages;
+    size_t allocated = 0;
+    TypeBytes freed;
+};
+
+// Objects which live as long as the program, like the functions and literals
+// of the constant pool. They are bump allocated and never freed or moved.
+// Collections do not visit them: they are always marked and may only point
+// to other permanent objects.
+class PermanentSpace {
+public:
+    static constexpr size_t regionSize = 16 * Chunk::pageBytes;
+    // Permanent objects are never aligned to a block either, so they keep
+    // their mark in the header.
+    static constexpr size_t objOffset = 8;
+    static_assert(objOffset % Page::blockSize != 0, "");
+
+    // Does not collect, several threads may allocate at the same time.
+    RVal* alloc(size_t sz) {
+        lock_guard<mutex> guard(lock);
+        size_t bytes = (sz + Page::blockSize - 1) & ~(Page::blockSize - 1);
+        if (top + bytes > limit)
+            map(bytes);
+        RVal* obj = reinterpret_cast<RVal*>(top);
+        top += bytes;
+        obj->mark = MARKED;
+        objects.push_back(obj);
+        used += sz;
+        return obj;
+    }
+
+    bool contains(RVal* obj) const {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(obj);
+        for (auto const & r : regions)
+            if (addr >= r.first && addr < r.first + r.second)
+                return true;
+        return false;
+    }
+
+    // Bytes taken by permanent objects, and the bytes mapped for them.
+    size_t size() const {
+        return used;
+    }
+
+    size_t mapped() const {
+        size_t total = 0;
+        for (auto const & r : regions)
+            total += r.second;
+        return total;
+    }
+
+    void verify() const;
+
+    PermanentSpace() {}
+
+    ~PermanentSpace() {
+        for (auto const & r : regions)
+            HeapRegion::release(reinterpret_cast<void*>(r.first), r.second);
+    }
+
+    PermanentSpace(PermanentSpace const &) = delete;
+    void operator= (PermanentSpace const &) = delete;
+
+private:
+    // Starts a new region with room for at least bytes. The rest of the
+    // current one is left unused.
+    void map(size_t bytes) {
+        size_t size = max(regionSize,
+                (objOffset + bytes + Chunk::pageBytes - 1) &
+                ~(Chunk::pageBytes - 1));
+        uintptr_t start = reinterpret_cast<uintptr_t>(
+                HeapRegion::take(size, Chunk::pageBytes));
+        regions.push_back(make_pair(start, size));
+        top = start + objOffset;
+        limit = start + size;
+    }
+
+    mutex lock;
+    uintptr_t top = 0;
+    uintptr_t limit = 0;
+    // Start and size of each mapping.
+    vector<pair<uintptr_t, size_t>> regions;
+    vector<RVal*> objects;
+    size_t used = 0;
+};
+
+
+// The young generation. New objects are bump allocated into the blocks of the
+// nursery and a minor collection evacuates the survivors into the arena. Each
+// thread allocates in a block of its own, its thread local allocation buffer,
+// so only taking a new block needs the heap lock.
+//
+// Roots found by the conservative stack scan cannot be updated, so a block
+// holding such an object is pinned: its objects stay where they are and the
+// whole block is promoted to the old generation. It returns to the nursery
+// once all its objects died.
+class Nursery {
+public:
+    static constexpr size_t blockBits = 13;
+    static constexpr size_t blockSize = 1 << blockBits;
+    // Blocks filled between two minor gcs.
+    static constexpr size_t activeBlocks = 64;
+    // Pinned blocks are promoted and stay in the old generation until all
+    // their objects die. They are replaced by blocks from a larger reserved
+    // area, so that the nursery does not shrink.
+    static constexpr size_t numBlocks = 1024;
+    static constexpr size_t size = blockSize * numBlocks;
+
+    // Objects are aligned to granules, each granule has a bit in the starts
+    // bitmap of its block.
+    static constexpr size_t granule = 8;
+    static constexpr size_t granuleBits = 3;
+    static constexpr size_t minObjSize = 16;
+    // Bigger objects are allocated in the old generation right away.
+    static constexpr size_t maxObjSize = 1024;
+
+    struct Block {
+        uintptr_t start, top;
+        // Holds an object referenced from the stack during a minor gc.
+        bool pinned;
+        // Belongs to the old generation.
+        bool promoted;
+        // One bit per granule, set where an object starts.
+        array<uint64_t, blockSize / granule / 64> starts;
+
+        bool used() const {
+            return top != start || promoted;
+        }
+
+        void setStart(uintptr_t addr) {
+            size_t g = (addr - start) >> granuleBits;
+            starts[g / 64] |= 1ull << (g % 64);
+        }
+
+        void clearStart(uintptr_t addr) {
+            size_t g = (addr - start) >> granuleBits;
+            starts[g / 64] &= ~(1ull << (g % 64));
+        }
+
+        bool empty() const {
+            for (auto w : starts)
+                if (w)
+                    return false;
+            return true;
+        }
+
+        // Calls f for every object in the block.
+        template <typename F>
+        void forEach(F f) {
+            for (size_t w = 0; w < starts.size(); ++w) {
+                uint64_t bits = starts[w];
+                while (bits) {
+                    size_t b = __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    f(reinterpret_cast<RVal*>(
+                        start + ((w * 64 + b) << granuleBits)));
+                }
+            }
+        }
+
+        void reset() {
+#ifdef GC_DEBUG
+            memset(reinterpret_cast<void*>(start), 0xd, top - start);
+#endif
+            top = start;
+            pinned = false;
+            promoted = false;
+            starts.fill(0);
+        }
+    };
+
+    // Space an object of sz bytes takes in a block.
+    static constexpr size_t allocSize(size_t sz) {
+        return sz < minObjSize ? minObjSize : (sz + granule - 1) & ~(granule - 1);
+    }
+
+    // Compiled code bump allocates past the top of the block without
+    // touching it. This records the objects up to top in the block and
+    // calls f for each of them.
+    template <typename F>
+    static void record(Block* b, uintptr_t top, F f) {
+        while (b->top < top) {
+            RVal* obj = reinterpret_cast<RVal*>(b->top);
+            size_t sz = objSize(obj);
+            b->setStart(b->top);
+            b->top += allocSize(sz);
+            f(obj, sz);
+        }
+        assert(b->top == top);
+    }
+
+    // Replaces the full block cur by a free one. Returns false once all
+    // blocks for this cycle are used up.
+    bool refill(Block*& cur) {
+        if (free.empty() || budget == 0)
+            return false;
+        --budget;
+        cur = free.back();
+        free.pop_back();
+        assert(!cur->used());
+        return true;
+    }
+
+    // A block without space. Threads start out with it, and get it back
+    // after each minor gc, so their next allocation takes a free block.
+    Block* exhaustedBlock() {
+        return &exhausted;
+    }
+
+    inline bool contains(uintptr_t addr) const {
+        return addr - base < size;
+    }
+
+    inline Block& block(uintptr_t addr) {
+        assert(contains(addr));
+        return blocks[(addr - base) >> blockBits];
+    }
+
+    // True for objects in the young generation. Null is not young.
+    inline bool isYoung(void* ptr) const {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        return contains(addr) && !blocks[(addr - base) >> blockBits].promoted;
+    }
+
+    // Resolves any pointer into a nursery object to its start.
+    RVal* findObj(void* ptr) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        if (!contains(addr))
+            return nullptr;
+        Block& b = block(addr);
+        if (addr >= b.top)
+            return nullptr;
+
+        // Find the last object start at or before addr.
+        size_t g = (addr - b.start) >> granuleBits;
+        size_t w = g / 64;
+        uint64_t bits = b.starts[w] & ((2ull << (g % 64)) - 1);
+        while (!bits && w > 0)
+            bits = b.starts[--w];
+        if (!bits)
+            return nullptr;
+
+        uintptr_t start = b.start +
+            ((w * 64 + 63 - __builtin_clzll(bits)) << granuleBits);
+        RVal* obj = reinterpret_cast<RVal*>(start);
+        if (addr >= start + objSize(obj))
+            return nullptr;
+        return obj;
+    }
+
+    // The forwarding address of an evacuated object is stored right after
+    // its header.
+    static RVal*& forwardee(RVal* obj) {
+        return *reinterpret_cast<RVal**>(
+                reinterpret_cast<uint8_t*>(obj) + sizeof(void*));
+    }
+
+    // Called after a minor gc evacuated all live objects. Pinned blocks are
+    // promoted, their unmarked objects are dead. All other blocks are empty
+    // again. While the old generation is being marked the survivors stay
+    // marked.
+    void finishScavenge(bool keepMarked = false) {
+        free.clear();
+        // Free blocks are taken from the back, keep low addresses in use.
+        for (auto i = blocks.rbegin(); i != blocks.rend(); ++i) {
+            Block& b = *i;
+            if (b.promoted)
+                continue;
+            if (b.pinned) {
+                // Young objects are accounted for by the minor gc.
+                sweep(b, keepMarked, nullptr);
+                b.pinned = false;
+                b.promoted = !b.empty();
+            }
+            if (!b.promoted) {
+                b.reset();
+                free.push_back(&b);
+            }
+        }
+        budget = activeBlocks;
+    }
+
+    // Sweeps the promoted blocks after a major gc marked the old generation.
+    void sweepPromoted() {
+        for (auto & b : blocks) {
+            if (!b.promoted)
+                continue;
+            sweep(b, false, &freed);
+            if (b.empty()) {
+                b.reset();
+                free.push_back(&b);
+            }
+        }
+    }
+
+    // Calls f for every object in the old generation part of the nursery.
+    template <typename F>
+    void forEachPromoted(F f) {
+        for (auto & b : blocks)
+            if (b.promoted)
+                b.forEach(f);
+    }
+
+    // True if there are enough free blocks for a full allocation cycle.
+    bool hasFree() const {
+        return free.size() >= activeBlocks;
+    }
+
+    // Memory in blocks which belong to the old generation.
+    size_t promotedSize() const {
+        return promotedBlocks() * blockSize;
+    }
+
+    size_t promotedBlocks() const {
+        size_t n = 0;
+        for (auto & b : blocks)
+            if (b.promoted)
+                ++n;
+        return n;
+    }
+
+    // Bytes of dead objects in promoted blocks.
+    TypeBytes const & freedBytes() const {
+        return freed;
+    }
+
+    // Memory used by young objects.
+    size_t used() const {
+        size_t s = 0;
+        for (auto & b : blocks)
+            if (!b.promoted)
+                s += b.top - b.start;
+        return s;
+    }
+
+    void verify();
+
+    Nursery() {
+        base = reinterpret_cast<uintptr_t>(HeapRegion::take(size, size));
+        for (size_t i = 0; i < numBlocks; ++i) {
+            Block& b = blocks[i];
+            b.start = b.top = base + i * blockSize;
+            b.reset();
+        }
+        exhausted.start = 0;
+        exhausted.top = blockSize;
+        finishScavenge();
+    }
+
+    ~Nursery() {
+        HeapRegion::release(reinterpret_cast<void*>(base), size);
+    }
+
+    Nursery(Nursery const &) = delete;
+    void operator= (Nursery const &) = delete;
+
+private:
+    // Objects which are not marked are dead, marked ones get unmarked unless
+    // keepMarked is set. Dead objects are counted in freed, if given.
+    static void sweep(Block& b, bool keepMarked, TypeBytes* freed) {
+        b.forEach([&b, keepMarked, freed] (RVal* obj) {
+            if (obj->mark == MARKED) {
+                if (!keepMarked)
+                    obj->mark = UNMARKED;
+            } else {
+                assert(obj->mark == UNMARKED);
+                if (freed)
+                    freed->add(obj, objSize(obj));
+                b.clearStart(reinterpret_cast<uintptr_t>(obj));
+            }
+        });
+    }
+
+    uintptr_t base;
+    array<Block, numBlocks> blocks;
+    // Blocks available for allocation.
+    vector<Block*> free;
+    // Number of blocks which can still be taken before the next minor gc.
+    size_t budget;
+    Block exhausted;
+    TypeBytes freed;
+};
+
+
+// Arena objects are marked in the side table of their chunk. Nursery objects
+// and large objects keep the mark in their header.
+inline bool hasMarkBit(Nursery const & nursery, RVal* obj) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(obj);
+    return !nursery.contains(addr) && !(addr & Page::pointerMask);
+}
+
+// Whether the marker has to visit the fields of obj. For arena objects the
+// page tells, so marking a leaf does not touch it at all.
+inline bool hasPointers(Nursery const & nursery, RVal* obj) {
+    if (hasMarkBit(nursery, obj))
+        return !Arena::pageOf(obj)->leaf;
+    return !isLeaf(obj->type);
+}
+
+
+// Marks obj with an atomic operation, for when other threads might race to
+// mark the same object or its neighbours in the bitmap. Returns false if obj
+// was marked already.
+inline bool tryMark(Nursery const & nursery, RVal* obj) {
+    if (hasMarkBit(nursery, obj)) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(obj);
+        uint64_t bit = Chunk::markBit(addr);
+        return !(__atomic_fetch_or(Chunk::markWord(addr), bit,
+                        __ATOMIC_RELAXED) & bit);
+    }
+    Mark expected = UNMARKED;
+    if (__atomic_compare_exchange_n(&obj->mark, &expected, MARKED,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return true;
+    assert(expected == MARKED);
+    return false;
+}
+
+
+// Chase-Lev work stealing deque of grey objects. The owning thread pushes
+// and pops at the bottom, other threads steal from the top.
+class MarkDeque {
+public:
+    MarkDeque() : top(0), bottom(0), buffer(new Buffer(initialCapacity)) { }
+
+    ~MarkDeque() {
+        delete buffer.load();
+        releaseRetired();
+    }
+
+    MarkDeque(MarkDeque const &) = delete;
+    void operator= (MarkDeque const &) = delete;
+
+    void push(RVal* obj) {
+        int64_t b = bottom.load(memory_order_relaxed);
+        int64_t t = top.load(memory_order_acquire);
+        Buffer* buf = buffer.load(memory_order_relaxed);
+        if (b - t >= static_cast<int64_t>(buf->capacity))
+            buf = grow(buf, t, b);
+        buf->put(b, obj);
+        atomic_thread_fence(memory_order_release);
+        bottom.store(b + 1, memory_order_relaxed);
+    }
+
+    // Only called by the owner. Returns nullptr if the deque is empty.
+    RVal* pop() {
+        int64_t b = bottom.load(memory_order_relaxed) - 1;
+        Buffer* buf = buffer.load(memory_order_relaxed);
+        bottom.store(b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = top.load(memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, memory_order_relaxed);
+            return nullptr;
+        }
+        RVal* obj = buf->get(b);
+        if (t == b) {
+            // Last element, race against thieves.
+            if (!top.compare_exchange_strong(t, t + 1,
+                        memory_order_seq_cst, memory_order_relaxed))
+                obj = nullptr;
+            bottom.store(b + 1, memory_order_relaxed);
+        }
+        return obj;
+    }
+
+    // Called by other threads. Returns nullptr if the deque is empty or
+    // another thread won the race.
+    RVal* steal() {
+        int64_t t = top.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = bottom.load(memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+        RVal* obj = buffer.load(memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1,
+                    memory_order_seq_cst, memory_order_relaxed))
+            return nullptr;
+        return obj;
+    }
+
+    bool empty() const {
+        return top.load(memory_order_acquire) >=
+            bottom.load(memory_order_acquire);
+    }
+
+    // Frees buffers replaced by grow. Only safe while nobody steals.
+    void releaseRetired() {
+        for (auto b : retired)
+            delete b;
+        retired.clear();
+    }
+
+private:
+    static constexpr size_t initialCapacity = 1024;
+
+    struct Buffer {
+        size_t capacity;
+        unique_ptr<atomic<RVal*>[]> items;
+
+        explicit Buffer(size_t capacity) :
+            capacity(capacity), items(new atomic<RVal*>[capacity]) { }
+
+        RVal* get(int64_t i) const {
+            return items[i & (capacity - 1)].load(memory_order_relaxed);
+        }
+
+        void put(int64_t i, RVal* obj) {
+            items[i & (capacity - 1)].store(obj, memory_order_relaxed);
+        }
+    };
+
+    Buffer* grow(Buffer* old, int64_t t, int64_t b) {
+        Buffer* buf = new Buffer(old->capacity * 2);
+        for (int64_t i = t; i < b; ++i)
+            buf->put(i, old->get(i));
+        // Thieves might still read from the old buffer.
+        retired.push_back(old);
+        buffer.store(buf, memory_order_release);
+        return buf;
+    }
+
+    atomic<int64_t> top;
+    atomic<int64_t> bottom;
+    atomic<Buffer*> buffer;
+    vector<Buffer*> retired;
+};
+
+// Marks the old generation using several threads. The thread running the gc
+// takes part as worker 0, the others wait until there is marking to do.
+class ParallelMarker {
+public:
+    explicit ParallelMarker(Nursery const & nursery) : nursery(nursery) {
+        unsigned n = thread::hardware_concurrency();
+        setThreads(n ? n : 1);
+    }
+
+    ~ParallelMarker() {
+        stopWorkers();
+    }
+
+    ParallelMarker(ParallelMarker const &) = delete;
+    void operator= (ParallelMarker const &) = delete;
+
+    unsigned threads() const {
+        return deques.size();
+    }
+
+    // Sets the number of marking threads, counting the caller. The workers
+    // are started by the first drain.
+    void setThreads(unsigned n);
+
+    // Visits the objects on stack and everything reachable from them, until
+    // done or the time budget is used up. Grey objects left over are put
+    // back on the stack. Returns true if marking is done.
+    bool drain(vector<RVal*>& stack, double budget);
+
+private:
+    void startWorkers();
+    void stopWorkers();
+    void workerMain(unsigned id, unsigned seen);
+    void work(unsigned id, double budget);
+    RVal* steal(unsigned id);
+    bool hasWork() const;
+
+    Nursery const & nursery;
+    vector<unique_ptr<MarkDeque>> deques;
+    vector<thread> workers;
+
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    unsigned round = 0;
+    unsigned finished = 0;
+    bool shutdown = false;
+    double budget = 0;
+
+    // Number of workers which ran out of work. When all of them are idle
+    // all deques are empty and marking is done.
+    atomic<unsigned> idle;
+    // Set by worker 0 when the time budget is used up.
+    atomic<bool> stop;
+};
+
+
+// Explicit stack of root slots. Compiled code and the runtime keep the
+// pointers they still need across an allocation in here, so the collector
+// finds them without guessing and can update them when objects move. The
+// slots are reserved up front, frames never move.
+class ShadowStack {
+public:
+    static constexpr size_t maxSlots = 1 << 22;
+
+    ShadowStack() {
+        void* mem = mmap(nullptr, maxSlots * sizeof(RVal*),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED)
+            throw bad_alloc();
+        base = top = watermark = static_cast<RVal**>(mem);
+        limit = base + maxSlots;
+    }
+
+    ~ShadowStack() {
+        munmap(base, maxSlots * sizeof(RVal*));
+    }
+
+    ShadowStack(ShadowStack const &) = delete;
+    void operator= (ShadowStack const &) = delete;
+
+    // Returns a frame of n empty slots. Only the code which pushed a frame
+    // writes to it, while it is the innermost one.
+    RVal** push(size_t n) {
+        RVal** frame = pushSlots(n);
+        frames.push_back(frame);
+        return frame;
+    }
+
+    // Adds n empty slots to the innermost frame.
+    RVal** pushSlots(size_t n) {
+        if (n > static_cast<size_t>(limit - top))
+            throw bad_alloc();
+        RVal** slots = top;
+        memset(slots, 0, n * sizeof(RVal*));
+        top += n;
+        return slots;
+    }
+
+    // Drops frame and everything pushed after it. The frame below becomes
+    // the innermost one again and may change its slots.
+    void pop(RVal** frame) {
+        assert(frame >= base && frame <= top);
+        top = frame;
+        while (!frames.empty() && frames.back() >= frame)
+            frames.pop_back();
+        watermark = min(watermark, innermost());
+    }
+
+    // Must be called when a slot is written by code other than the owner
+    // of the innermost frame.
+    void written(RVal** slot) {
+        watermark = min(watermark, slot);
+    }
+
+    template <typename F>
+    void forEach(F f) {
+        for (RVal** slot = base; slot < top; ++slot)
+            if (*slot)
+                f(slot);
+    }
+
+    // Calls f for the slots which changed since the last call to
+    // rescanned(). The ones below the watermark belong to frames whose
+    // code is suspended in a call, and were not written since.
+    template <typename F>
+    void forEachChanged(F f) {
+        for (RVal** slot = watermark; slot < top; ++slot)
+            if (*slot)
+                f(slot);
+    }
+
+    template <typename F>
+    void forEachUnchanged(F f) {
+        for (RVal** slot = base; slot < watermark; ++slot)
+            if (*slot)
+                f(slot);
+    }
+
+    // The slots were scanned, only the innermost frame may change until
+    // the next frame is popped.
+    void rescanned() {
+        watermark = innermost();
+    }
+
+    size_t changedSlots() const {
+        return top - watermark;
+    }
+
+private:
+    RVal** innermost() const {
+        return frames.empty() ? base : frames.back();
+    }
+
+    RVal** base;
+    RVal** top;
+    RVal** limit;
+    RVal** watermark;
+    // Start of each frame, the innermost one last.
+    vector<RVal**> frames;
+};
+
+
+// Bump pointer and end of the free space a thread allocates from.
+struct AllocationBuffer {
+    uintptr_t top;
+    uintptr_t limit;
+};
+
+// A thread which allocates objects or holds pointers to them. Everything the
+// thread touches without holding the heap lock is kept in here.
+struct Mutator {
+    // Free part of tlab. Compiled code allocates from it inline, so it has
+    // to stay the first member.
+    AllocationBuffer buffer;
+    Nursery::Block* tlab;
+    ShadowStack shadow;
+    // Filled by the write barrier and handed to the collector when the
+    // world is stopped: old objects which got a pointer to a young one, and
+    // objects shaded while marking.
+    vector<RVal*> remset;
+    vector<RVal*> grey;
+    TypeBytes allocated;
+    // Allocated in the nursery since the last minor gc.
+    TypeBytes youngAllocated;
+    // The C stack of the thread, top is only valid while it is stopped.
+    const void* stackBase;
+    const void* stackTop;
+};
+
+// Sizes the old generation such that full collections take a target share
+// of the run time. Every cycle measures how fast the mutator fills the old
+// generation, and how long collecting it takes per live byte. With a target
+// overhead o, a collection which costs c seconds may happen every
+// c * (1 - o) / o seconds of mutator time, the headroom above the live data
+// is what gets promoted in that time.
+class HeapPacer {
+public:
+    static constexpr double defaultOverhead = 0.05;
+    // Bounds of the headroom as a multiple of the live data.
+    static constexpr double minGrowth = 0.25;
+    static constexpr double maxGrowth = 4.0;
+    // Weight of the latest cycle in the running estimates.
+    static constexpr double smoothing = 0.5;
+
+    void setOverhead(double fraction) {
+        overhead = min(max(fraction, 0.001), 0.9);
+    }
+
+    double targetOverhead() const {
+        return overhead;
+    }
+
+    void minorPause(double seconds) {
+        minorTime += seconds;
+    }
+
+    void majorPause(double seconds) {
+        majorTime += seconds;
+    }
+
+    // The old generation held used bytes when marking started.
+    void markingStarted(size_t used) {
+        markStart = chrono::steady_clock::now();
+        usedAtMark = used;
+        minorTimeAtMark = minorTime;
+        majorTimeAtMark = majorTime;
+    }
+
+    // Called once the collection swept the arena, live bytes survived.
+    // Returns the new heap limit and starts the next cycle.
+    size_t finishCycle(size_t live, size_t minHeapSize);
+
+    // Bytes per second the mutator promoted in the last cycle, and the share
+    // of the last cycle spent in full collections.
+    double promotionRate() const {
+        return rate;
+    }
+
+    double lastOverhead() const {
+        return measuredOverhead;
+    }
+
+private:
+    double overhead = defaultOverhead;
+    double rate = 0;
+    double costPerByte = 0;
+    double measuredOverhead = 0;
+    bool measured = false;
+
+    chrono::steady_clock::time_point cycleStart = chrono::steady_clock::now();
+    chrono::steady_clock::time_point markStart = cycleStart;
+    size_t lastLive = 0;
+    size_t usedAtMark = 0;
+    // Pause times since the cycle started.
+    double minorTime = 0;
+    double majorTime = 0;
+    double minorTimeAtMark = 0;
+    double majorTimeAtMark = 0;
+};
+
+// A group of locations outside of the heap which hold pointers to live
+// objects, registered at once with addRoots.
+class RootSet {
+public:
+    virtual ~RootSet() {}
+
+    // Calls f with the address of every location, f updates it if the
+    // object moves. Runs while all mutators are stopped.
+    virtual void forEachRoot(function<void(RVal**)> const & f) = 0;
+};
+
+class GarbageCollector {
+public:
+    // Interface to request memory from the GC
+    static RVal* alloc(size_t sz, Type type) {
+        return inst().doAlloc(mutator(), sz, type);
+    }
+
+    // Allocates an object which is never freed, see PermanentSpace. Its
+    // fields may only point to permanent objects. Never collects, so
+    // pointers stay valid across the call.
+    static RVal* allocPermanent(size_t sz, Type type) {
+        RVal* res = inst().permanent.alloc(sz);
+        res->type = type;
+        res->remembered = false;
+        res->named = 0;
+        return res;
+    }
+
+    // The allocation buffer of the calling thread. It stays valid while the
+    // thread is attached, the collector refills it.
+    static AllocationBuffer* allocationBuffer() {
+        return &mutator().buffer;
+    }
+
+    // Must be called after storing a pointer to val into obj. Records old
+    // objects pointing into the nursery, which are roots for minor gcs.
+    // While the old generation is marked incrementally it also keeps marked
+    // objects from pointing to unmarked ones.
+    static inline void writeBarrier(RVal* obj, RVal* val) {
+        // Two threads might both add obj to their remembered set, which is
+        // harmless. Other threads might mark concurrently.
+        GarbageCollector& gc = inst();
+        if (gc.nursery.isYoung(val)) {
+            if (!gc.nursery.isYoung(obj) && !obj->remembered) {
+                obj->remembered = true;
+                mutator().remset.push_back(obj);
+            }
+        } else if (gc.marking && val && !isImmediate(val) &&
+                gc.isMarked(obj) && tryMark(gc.nursery, val)) {
+            mutator().grey.push_back(val);
+        }
+    }
+
+    // Upper bound in seconds for a single incremental marking step. With a
+    // target of 0 the old generation is collected in one pause.
+    static void setPauseTarget(double seconds) {
+        inst().pauseTarget = seconds;
+    }
+
+    // Number of threads marking the old generation, including the one
+    // running the gc.
+    static void setMarkThreads(unsigned n) {
+        inst().marker.setThreads(n);
+    }
+
+    // Size in bytes the old generation may grow to before it is
+    // collected. The pacer changes it with every collection, but it never
+    // drops below the minimum size.
+    static void setHeapSize(size_t bytes) {
+        GarbageCollector& gc = inst();
+        gc.heapLimit = max(bytes, gc.minHeapSize);
+    }
+
+    static void setMinHeapSize(size_t bytes) {
+        GarbageCollector& gc = inst();
+        gc.minHeapSize = max(bytes, MIN_HEAP_SIZE);
+        gc.heapLimit = max(gc.heapLimit, gc.minHeapSize);
+    }
+
+    // Share of the run time to be spent in full collections, see
+    // HeapPacer. Lower targets give a bigger heap.
+    static void setGcOverhead(double fraction) {
+        inst().pacer.setOverhead(fraction);
+    }
+
+    // Bytes of free arena pages kept for reuse, the memory of any further
+    // free page is returned to the OS.
+    static void setRetainedSize(size_t bytes) {
+        inst().arena.setRetainLimit(bytes);
+    }
+
+    // Full collection of both generations.
+    static void collect();
+
+    // Registers a location outside of the heap which holds a pointer to a
+    // live object. The slot is updated if the object moves.
+    static void addRoot(RVal** slot);
+
+    // Registers all locations of set, until removeRoots is called with it.
+    static void addRoots(RootSet* set);
+    static void removeRoots(RootSet* set);
+
+    // Pushes a frame of n empty root slots on the shadow stack of the
+    // calling thread. Use HandleScope and Handle from C++ code.
+    static RVal** enterFrame(size_t n) {
+        return mutator().shadow.push(n);
+    }
+
+    // Adds n empty root slots to the innermost frame.
+    static RVal** pushSlots(size_t n) {
+        return mutator().shadow.pushSlots(n);
+    }
+
+    // Pops frame and all frames above it from the shadow stack.
+    static void leaveFrame(RVal** frame) {
+        mutator().shadow.pop(frame);
+    }
+
+    // Minor gcs only scan the slots of the frames which were active since
+    // the last one, see ShadowStack. Writing to a slot of an outer frame
+    // has to be reported.
+    static void slotWritten(RVal** slot) {
+        mutator().shadow.written(slot);
+    }
+
+    // Collections stop all threads. They stop when they allocate a new
+    // block, wait for the heap lock or call this. Code which runs for long
+    // without allocating has to call it now and then. Compiled code checks
+    // safepointRequested() at function entries and loop back edges.
+    static void safepoint() {
+        GarbageCollector& gc = inst();
+        if (gc.stopRequested.load(memory_order_acquire))
+            gc.park(mutator());
+    }
+
+    static atomic<bool> const * safepointRequested() {
+        return &inst().stopRequested;
+    }
+
+    // Threads other than the one which created the collector have to be
+    // attached before they allocate, see MutatorScope.
+    static void attach(Mutator& m);
+    static void detach(Mutator& m);
+
+    // Other threads may collect while the calling thread is in a blocking
+    // region. It must not touch the heap until it leaves the region.
+    static void enterBlocking(void const * stackTop);
+    static void leaveBlocking();
+
+    // In conservative mode the C stack is scanned for anything looking like
+    // a pointer in addition to the shadow stack, and objects it finds are
+    // pinned. Only needed for code which keeps raw pointers across
+    // allocations.
+    static void setConservative(bool enabled) {
+        inst().conservative = enabled;
+    }
+
+    static bool isConservative() {
+        return inst().conservative;
+    }
+
+    struct PauseStats {
+        // Pauses are counted in buckets by powers of two: bucket i holds
+        // the pauses below 2^i us which do not fit into bucket i-1, the last
+        // one everything longer.
+        static constexpr size_t buckets = 20;
+
+        size_t count = 0;
+        double total = 0;
+        double max = 0;
+        array<size_t, buckets> histogram{};
+
+        void record(double seconds) {
+            count++;
+            total += seconds;
+            if (seconds > max)
+                max = seconds;
+            size_t b = 0;
+            for (double limit = 1e-6; seconds >= limit && b < buckets - 1;
+                    limit *= 2)
+                ++b;
+            histogram[b]++;
+        }
+
+        double average() const {
+            return count ? total / count : 0;
+        }
+
+        // Upper bound of bucket b in seconds.
+        static double bucketLimit(size_t b) {
+            return 1e-6 * (1ull << b);
+        }
+    };
+
+    // The old generation after a full collection.
+    struct HeapSample {
+        // Seconds since the gc was initialized.
+        double time;
+        size_t size;
+        size_t limit;
+        size_t live;
+    };
+
+    struct Stats {
+        PauseStats minor;
+        PauseStats major;
+        // Completed collections of the old generation, and how many of them
+        // compacted the arena.
+        size_t collections;
+        size_t compactions;
+        TypeBytes allocated;
+        TypeBytes freed;
+        size_t heapSize;
+        size_t heapLimit;
+        // The estimates of the pacer, and its target.
+        double promotionRate;
+        double gcOverhead;
+        double targetOverhead;
+        size_t arenaPages;
+        size_t leafPages;
+        size_t retainedPages;
+        size_t permanentSize;
+        array<Arena::ClassStats, Arena::numClasses> classes;
+        size_t largeObjects;
+        size_t promotedBlocks;
+        // The most recent full collections, oldest first.
+        deque<HeapSample> heap;
+    };
+
+    // The counters are always updated, taking a snapshot is cheap enough
+    // to do it at any time.
+    static Stats stats();
+
+    // Human readable summary of stats().
+    static void printStats(ostream & s);
+
+    static PauseStats const & minorPauses() {
+        return inst().minorPauses_;
+    }
+
+    static PauseStats const & majorPauses() {
+        return inst().majorPauses_;
+    }
+
+private:
+    // New objects are allocated in the nursery. Survivors of a minor gc are
+    // moved to the old generation: Small objects live in the arena, which
+    // keeps separate pages for each size class. Everything bigger than a
+    // page goes to the large object space. Objects of the permanent space are
+    // not part of either generation.
+    Nursery nursery;
+    Arena arena;
+    LargeObjectSpace los;
+    PermanentSpace permanent;
+    ParallelMarker marker{nursery};
+    bool conservative = false;
+
+    // All attached threads. The thread which created the collector is
+    // attached with mainMutator.
+    static thread_local Mutator* current;
+    vector<Mutator*> mutators;
+    Mutator mainMutator;
+
+    // Held for the slow path of allocation and for collections.
+    mutex heapLock;
+    // Protects parked and wakes up stopped threads.
+    mutex stateLock;
+    condition_variable stopped;
+    condition_variable resumed;
+    // Set by the thread which wants to collect. The world is stopped once
+    // all other threads are parked.
+    atomic<bool> stopRequested{false};
+    bool worldStopped = false;
+    size_t parked = 0;
+
+    // Old objects which might point into the nursery.
+    vector<RVal*> remset;
+    vector<RVal**> roots;
+    vector<RootSet*> rootSets;
+    // Objects found live during a minor gc whose fields still need to be
+    // scavenged.
+    vector<RVal*> grey;
+    // True while a minor gc is running.
+    bool scavenging = false;
+    // True while the stack is scanned for pages to pin before a compaction.
+    bool compacting = false;
+
+    // Marked objects of the old generation whose fields still need to be
+    // visited.
+    vector<RVal*> markStack;
+    // True while the old generation is marked incrementally. Old objects
+    // allocated in the meantime are marked right away.
+    bool marking = false;
+    double pauseTarget = 0.001;
+    // The heap limit is adjusted once the arena is swept, only then the free
+    // space is known.
+    bool resizePending = false;
+    HeapPacer pacer;
+
+    PauseStats minorPauses_;
+    PauseStats majorPauses_;
+    size_t collections = 0;
+    size_t compactions = 0;
+    // Counters of threads which were detached already. Young objects which
+    // do not survive a minor gc are counted in youngFreed.
+    TypeBytes detachedAllocated;
+    TypeBytes detachedYoungAllocated;
+    TypeBytes youngFreed;
+    constexpr static size_t maxHeapSamples = 256;
+    deque<HeapSample> heapSamples;
+    const chrono::steady_clock::time_point startTime =
+        chrono::steady_clock::now();
+
+    constexpr static size_t INITIAL_HEAP_SIZE = 4*Page::size;
+    constexpr static size_t MIN_HEAP_SIZE = 4*Page::size;
+    static_assert (INITIAL_HEAP_SIZE >= MIN_HEAP_SIZE, "");
+
+    size_t heapLimit = INITIAL_HEAP_SIZE;
+    size_t minHeapSize = MIN_HEAP_SIZE;
+    // Marking is finished in one pause if the old generation grows past
+    // this multiple of the heap limit before it completes.
+    constexpr static double HEAP_HARD_RATIO = 2.0f;
+
+    static Mutator& mutator() {
+        // The constructor attaches the thread which creates the collector.
+        if (!current)
+            inst();
+        assert(current && "thread is not attached to the gc");
+        return *current;
+    }
+
+    // The fast path needs no lock, the thread owns its block.
+    RVal* doAlloc(Mutator& m, size_t sz, Type type) {
+        RVal* res;
+        size_t bytes = Nursery::allocSize(sz);
+        if (sz <= Nursery::maxObjSize &&
+                m.buffer.top + bytes <= m.buffer.limit) {
+            // Compiled code bumps the buffer without recording its objects
+            if (m.tlab->top != m.buffer.top)
+                flush(m);
+            res = reinterpret_cast<RVal*>(m.buffer.top);
+            m.buffer.top += bytes;
+            m.tlab->setStart(m.tlab->top);
+            m.tlab->top = m.buffer.top;
+            res->mark = UNMARKED;
+            res->type = type;
+            m.allocated.add(res, sz);
+            m.youngAllocated.add(res, sz);
+        } else {
+            res = allocSlow(m, sz, type);
+        }
+        res->remembered = false;
+        res->named = 0;
+        return res;
+    }
+
+    // Takes a new block, or allocates in the old generation. Collects if
+    // needed.
+    RVal* allocSlow(Mutator& m, size_t sz, Type type);
+
+    // Records the objects compiled code allocated from the buffer of m in
+    // its block.
+    void flush(Mutator& m);
+
+    // Hands the free part of m's block to its buffer.
+    static void setBuffer(Mutator& m, Nursery::Block* block) {
+        m.tlab = block;
+        m.buffer.top = block->top;
+        m.buffer.limit = block->start + Nursery::blockSize;
+    }
+
+    // Taking the heap lock is a safepoint: while a thread waits for it, the
+    // thread holding the lock may collect.
+    void lockHeap(Mutator& m);
+    void unlockHeap() {
+        heapLock.unlock();
+    }
+    class HeapLock;
+
+    // Waits until all other threads are parked, unless the world is stopped
+    // already. Their write barrier buffers are taken over. Returns false if
+    // the world was stopped already.
+    bool stopWorld();
+    void resumeWorld();
+    class WorldStop;
+
+    // Stops the calling thread while another one collects.
+    void park(Mutator& m);
+    // The thread does not touch the heap until it leaves, it counts as
+    // parked. The C stack above stackTop is scanned in conservative mode.
+    void enterSafeRegion(Mutator& m, void const * stackTop);
+    void leaveSafeRegion();
+
+    // Calls f with every registered root.
+    template <typename F>
+    void forEachRoot(F f) {
+        for (auto slot : roots)
+            f(slot);
+        for (auto set : rootSets)
+            set->forEachRoot(f);
+    }
+
+    template <typename F>
+    void forEachShadowSlot(F f) {
+        for (auto m : mutators)
+            m->shadow.forEach(f);
+    }
+
+    RVal* doAllocOld(size_t sz, Type type) {
+        if (sz > Page::size)
+            return doAllocLarge(sz);
+
+        RVal* res = arena.alloc(sz, isLeaf(type), size() < heapLimit);
+
+        //  Allocation failed
+        if (!res) {
+            collectOld();
+            res = arena.alloc(sz, isLeaf(type), true);
+        }
+
+        if (!res) throw bad_alloc();
+        // Other threads might mark objects in the same bitmap word.
+        if (marking)
+            tryMark(nursery, res);
+        return res;
+    };
+
+    RVal* doAllocLarge(size_t sz) {
+        if (size() + sz > heapLimit)
+            collectOld();
+
+        RVal* res = los.alloc(sz);
+        if (marking)
+            res->mark = MARKED;
+        return res;
+    }
+
+    // Size of the old generation.
+    size_t size() const {
+        return arena.size() + los.size() + nursery.promotedSize();
+    }
+
+    size_t free() const {
+        return arena.free();
+    }
+
+    // Scans the C stack of the calling thread, and the stacks of all
+    // parked threads.
+    void scanStack();
+    void scanStack(void* const * from, void const * to);
+
+    // Marks registered roots, the shadow stack and in conservative mode the
+    // C stack.
+    void markRoots();
+
+    // Full collection of both generations. Finishes an incremental mark if
+    // one is in progress.
+    void doGc();
+
+    // Called when the old generation reached its limit. Starts or continues
+    // incremental marking, or collects right away.
+    void collectOld();
+    // One pause of incremental marking.
+    void markStep();
+
+    // Marks the roots and the stack.
+    void startMarking();
+    // Visits grey objects until the mark stack is empty or the time budget
+    // is used up. Returns true if the mark stack is empty.
+    bool drainMarkStack(double budget);
+    // Marks whatever the mutator changed since marking started and sweeps.
+    // A fragmented arena is swept right away and compacted.
+    void finishMarking();
+    // Moves the objects of sparsely used arena pages into denser ones and
+    // releases the emptied pages.
+    void compact();
+    // Sweeps lazily swept pages until the pause target is used up.
+    void sweepStep();
+    // Sweeps all remaining pages and adjusts the heap limit.
+    void finishSweep();
+
+    // Collection of the nursery only. Followed by a full collection if the
+    // old generation outgrew the heap limit.
+    void minorGc();
+    // Evacuates the nursery.
+    void scavenge();
+
+    // Evacuates the young object slot points to, or marks it if it cannot
+    // be moved, and updates the slot.
+    void scavenge(RVal** slot);
+
+    // Called by the stack scan for every word on the stack.
+    inline void scanRoot(void* ptr) {
+        if (scavenging) {
+            if (!nursery.isYoung(ptr))
+                return;
+            if (RVal* obj = nursery.findObj(ptr)) {
+                nursery.block(reinterpret_cast<uintptr_t>(obj)).pinned = true;
+                if (obj->mark != MARKED) {
+                    obj->mark = MARKED;
+                    grey.push_back(obj);
+                }
+            }
+        } else if (compacting) {
+            arena.pin(ptr);
+        } else if (RVal* obj = findObj(ptr)) {
+            shade(obj);
+        }
+    }
+
+    // Returns the object ptr points into, or nullptr if it does not point
+    // into a live heap object.
+    inline RVal* findObj(void* ptr) {
+        if (RVal* obj = arena.findObj(ptr))
+            return obj;
+        if (RVal* obj = nursery.findObj(ptr))
+            return obj;
+        return los.findObj(ptr);
+    }
+
+    // Marks an old object and pushes it on the mark stack. Young objects
+    // are left to the minor gc.
+    void shade(RVal* val) {
+        if (!val || isImmediate(val) || nursery.isYoung(val))
+            return;
+#ifdef GC_DEBUG
+        assert(findObj(val) == val || permanent.contains(val));
+#endif
+        if (setMarked(val) && hasPointers(nursery, val))
+            markStack.push_back(val);
+    }
+
+    bool isMarked(RVal* obj) const {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(obj);
+        if (hasMarkBit(nursery, obj))
+            return *Chunk::markWord(addr) & Chunk::markBit(addr);
+        return obj->mark == MARKED;
+    }
+
+    // Returns false if obj was marked already.
+    bool setMarked(RVal* obj) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(obj);
+        if (hasMarkBit(nursery, obj)) {
+            uint64_t* word = Chunk::markWord(addr);
+            uint64_t bit = Chunk::markBit(addr);
+            if (*word & bit)
+                return false;
+            *word |= bit;
+            return true;
+        }
+        if (obj->mark == MARKED)
+            return false;
+        assert(obj->mark == UNMARKED);
+        obj->mark = MARKED;
+        return true;
+    }
+
+    void visitChildren(RVal*);
+
+    // Delete everything which is not reachable anymore. The arena is only
+    // prepared for lazy sweeping.
+    void sweep() {
+        arena.startSweep();
+        los.sweep();
+        nursery.sweepPromoted();
+    }
+
+    void verify() {
+        arena.verify();
+        los.verify();
+        nursery.verify();
+        permanent.verify();
+    }
+
+    static GarbageCollector & inst() {
+        static GarbageCollector gc;
+        return gc;
+    }
+
+    // The stack is scanned up to its very base. Using the frame of the first
+    // allocation instead would miss live objects in the frames of its
+    // callers.
+#ifdef __GNUG__
+    static const void * stackBase();
+#else
+    static const void * stackBase() {
+        return _AddressOfReturnAddress();
+    }
+#endif
+
+    GarbageCollector() {
+        setBuffer(mainMutator, nursery.exhaustedBlock());
+        mainMutator.stackBase = stackBase();
+        mutators.push_back(&mainMutator);
+        current = &mainMutator;
+    }
+
+    GarbageCollector(GarbageCollector const &) = delete;
+    void operator=(GarbageCollector const &) = delete;
+    friend void ::scanStack_();
+};
+
+
+// Attaches the calling thread to the collector for its lifetime.
+class MutatorScope {
+public:
+    MutatorScope() {
+        GarbageCollector::attach(mutator);
+    }
+
+    ~MutatorScope() {
+        GarbageCollector::detach(mutator);
+    }
+
+    MutatorScope(MutatorScope const &) = delete;
+    void operator= (MutatorScope const &) = delete;
+
+private:
+    Mutator mutator;
+};
+
+// Lets other threads collect while the calling thread blocks, for example
+// when it waits for another thread.
+class BlockingRegion {
+public:
+    __attribute__((noinline)) BlockingRegion() {
+        // Pointers held in callee saved registers end up in the scanned part
+        // of the stack.
+        setjmp(registers);
+        GarbageCollector::enterBlocking(__builtin_frame_address(0));
+    }
+
+    ~BlockingRegion() {
+        GarbageCollector::leaveBlocking();
+    }
+
+    BlockingRegion(BlockingRegion const &) = delete;
+    void operator= (BlockingRegion const &) = delete;
+
+private:
+    jmp_buf registers;
+};
+
+// Releases all handles created during its lifetime. Also drops frames of
+// compiled code which were left behind by an exception.
+class HandleScope {
+public:
+    HandleScope() : saved(GarbageCollector::enterFrame(0)) { }
+
+    ~HandleScope() {
+        GarbageCollector::leaveFrame(saved);
+    }
+
+    HandleScope(HandleScope const &) = delete;
+    void operator= (HandleScope const &) = delete;
+
+    // n empty root slots, valid until the scope ends.
+    RVal** slots(size_t n) {
+        return GarbageCollector::pushSlots(n);
+    }
+
+private:
+    RVal** saved;
+};
+
+// A pointer to a heap object which stays valid across allocations. It lives
+// in a shadow stack slot of the innermost HandleScope.
+template <typename T>
+class Handle {
+public:
+    Handle(T* val) : slot(GarbageCollector::pushSlots(1)) {
+        *slot = val;
+    }
+
+    // Copies get a slot of their own.
+    Handle(Handle const & other) : Handle(other.get()) { }
+
+    // The scope of the handle might not be the innermost one any more.
+    Handle& operator= (T* val) {
+        *slot = val;
+        GarbageCollector::slotWritten(slot);
+        return *this;
+    }
+
+    Handle& operator= (Handle const & other) {
+        *slot = *other.slot;
+        GarbageCollector::slotWritten(slot);
+        return *this;
+    }
+
+    T* get() const {
+        return static_cast<T*>(*slot);
+    }
+
+    operator T* () const {
+        return get();
+    }
+
+    T* operator-> () const {
+        return get();
+    }
+
+    T& operator* () const {
+        return *get();
+    }
+
+private:
+    RVal** slot;
+};
+
+} // namespace gc
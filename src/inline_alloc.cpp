@@ -0,0 +1,168 @@
+#if VERSION > 10
+
+#include <iostream>
+
+#include "inline_alloc.h"
+#include "rift.h"
+#include "compiler/compiler.h"
+#include "compiler/types.h"
+
+using namespace llvm;
+
+namespace rift {
+char InlineAllocation::ID = 0;
+
+namespace {
+
+/* Layout of a double vector of length one: the header bytes of RVal (type,
+ * mark, remembered and named), the length and the payload right after the
+ * struct.
+ */
+constexpr size_t scalarBytes =
+    gc::Nursery::allocSize(sizeof(DoubleVector) + sizeof(double));
+constexpr unsigned sizeOffset = sizeof(DoubleVector) - sizeof(unsigned);
+constexpr unsigned dataOffset = sizeof(DoubleVector);
+static_assert(sizeof(RVal) == 4, "");
+static_assert(sizeOffset >= sizeof(RVal), "");
+static_assert(scalarBytes <= gc::Nursery::maxObjSize, "");
+
+/* Stores value at offset bytes into obj. */
+void storeAt(IRBuilder<> & b, Value * obj, unsigned offset, Value * value) {
+    Value * field = b.CreateConstGEP1_32(obj, offset);
+    b.CreateStore(value, b.CreateBitCast(field,
+            PointerType::get(value->getType(), 0)));
+}
+
+Value * byte(uint8_t value) {
+    return ConstantInt::get(type::Character, value);
+}
+
+Value * word(uintptr_t value) {
+    return ConstantInt::get(type::Word, value);
+}
+
+/* The immediate of a constant literal, or nullptr if it has to be boxed. */
+Constant * constantImmediate(Value * value) {
+    ConstantFP * c = dyn_cast<ConstantFP>(value);
+    if (c == nullptr)
+        return nullptr;
+    double d = c->getValueAPF().convertToDouble();
+    if (!fitsImmediate(d))
+        return nullptr;
+    return ConstantExpr::getIntToPtr(ConstantInt::get(type::Word,
+            reinterpret_cast<uintptr_t>(toImmediate(d))), type::ptrValue);
+}
+
+}
+
+bool InlineAllocation::runOnFunction(Function & f) {
+    bool changed = false;
+    vector<CallInst *> literals;
+    for (auto & b : f)
+        for (auto & i : b)
+            if (CallInst * ci = dyn_cast<CallInst>(&i))
+                if (ci->getCalledFunction()->getName() == "doubleVectorLiteral")
+                    literals.push_back(ci);
+    // Constants which fit are immediates already
+    auto boxed = literals.begin();
+    for (CallInst * ci : literals) {
+        if (Constant * imm = constantImmediate(ci->getArgOperand(0))) {
+            ci->replaceAllUsesWith(imm);
+            ci->eraseFromParent();
+            changed = true;
+        } else {
+            *boxed++ = ci;
+        }
+    }
+    literals.erase(boxed, literals.end());
+    if (literals.empty())
+        return changed;
+
+    // The buffer of the thread stays the same while the function runs.
+    IRBuilder<> b(&*f.getEntryBlock().getFirstInsertionPt());
+    Value * buffer = b.CreateCall(Compiler::gcAllocBuffer(f.getParent()),
+            vector<Value*>(), "buffer");
+    for (CallInst * ci : literals)
+        lower(ci, buffer);
+
+    if (DEBUG) {
+        cout << "After inline allocation: ----------------------------------" << endl;
+        f.dump();
+    }
+    return true;
+}
+
+/** The top and limit of the buffer are accessed with volatile loads and
+    stores, the runtime calls around them are pure but a gc refills the
+    buffer.  */
+void InlineAllocation::lower(CallInst * ci, Value * buffer) {
+    LLVMContext & context = Compiler::context();
+    BasicBlock * head = ci->getParent();
+    Function * f = head->getParent();
+    BasicBlock * done = head->splitBasicBlock(ci, "allocated");
+    BasicBlock * tag = BasicBlock::Create(context, "tag", f, done);
+    BasicBlock * alloc = BasicBlock::Create(context, "alloc", f, done);
+    BasicBlock * fast = BasicBlock::Create(context, "allocFast", f, done);
+    BasicBlock * slow = BasicBlock::Create(context, "allocSlow", f, done);
+
+    // Splitting ended head with a branch to done, check the range of
+    // immediates instead. The comparisons are false for NaN.
+    head->getTerminator()->eraseFromParent();
+    Value * value = ci->getArgOperand(0);
+    IRBuilder<> b(head);
+    Value * inRange = b.CreateAnd(
+            b.CreateFCmpOGE(value, ConstantFP::get(type::Double, immediateMin)),
+            b.CreateFCmpOLE(value, ConstantFP::get(type::Double, immediateMax)));
+    b.CreateCondBr(inRange, tag, alloc);
+
+    // Integral values survive the round trip bit for bit, negative zero
+    // does not
+    b.SetInsertPoint(tag);
+    Value * integer = b.CreateFPToSI(value, type::Word);
+    Value * exact = b.CreateICmpEQ(
+            b.CreateBitCast(b.CreateSIToFP(integer, type::Double), type::Word),
+            b.CreateBitCast(value, type::Word));
+    Value * tagged = b.CreateIntToPtr(
+            b.CreateOr(b.CreateShl(integer, 1), word(1)), type::ptrValue);
+    b.CreateCondBr(exact, done, alloc);
+
+    // Otherwise check the limit of the buffer
+    b.SetInsertPoint(alloc);
+    Value * topSlot = b.CreateConstGEP1_32(buffer, 0);
+    Value * limitSlot = b.CreateConstGEP1_32(buffer, 1);
+    Value * top = b.CreateLoad(topSlot, true);
+    Value * next = b.CreateAdd(top, word(scalarBytes));
+    Value * fits = b.CreateICmpULE(next, b.CreateLoad(limitSlot, true));
+    b.CreateCondBr(fits, fast, slow);
+
+    // Bump the top and initialize the vector
+    b.SetInsertPoint(fast);
+    b.CreateStore(next, topSlot, true);
+    Value * obj = b.CreateIntToPtr(top, type::ptrCharacter);
+    storeAt(b, obj, 0, byte(static_cast<uint8_t>(::Type::Double)));
+    storeAt(b, obj, 1, byte(gc::UNMARKED));
+    storeAt(b, obj, 2, byte(false));
+    storeAt(b, obj, 3, byte(0));
+    storeAt(b, obj, sizeOffset, ConstantInt::get(type::Int, 1));
+    storeAt(b, obj, dataOffset, value);
+    Value * allocated = b.CreateBitCast(obj, type::ptrValue);
+    b.CreateBr(done);
+
+    // The runtime refills the buffer or collects
+    b.SetInsertPoint(slow);
+    Value * boxed = b.CreateCall(ci->getCalledFunction(),
+            vector<Value*>({value}), "");
+    b.CreateBr(done);
+
+    b.SetInsertPoint(ci);
+    PHINode * phi = b.CreatePHI(type::ptrValue, 3, "scalar");
+    phi->addIncoming(tagged, tag);
+    phi->addIncoming(allocated, fast);
+    phi->addIncoming(boxed, slow);
+    ci->replaceAllUsesWith(phi);
+    ci->eraseFromParent();
+}
+
+} // namespace rift
+
+#endif //VERSION
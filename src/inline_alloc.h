@@ -0,0 +1,30 @@
+#if VERSION > 10
+#pragma once
+
+#include "llvm.h"
+
+namespace rift {
+
+/** Replaces calls to doubleVectorLiteral by immediates, see isImmediate.
+    Constants are folded, other values are tagged if they fit. The rest is
+    bump allocated inline from the allocation buffer of the thread, the
+    runtime is only called when the buffer is full. Runs after the other
+    passes, which recognize scalars by these calls.
+ */
+class InlineAllocation : public llvm::FunctionPass {
+public:
+    static char ID;
+    InlineAllocation() : llvm::FunctionPass(ID) {}
+
+    llvm::StringRef getPassName() const override { return "InlineAllocation"; }
+
+    bool runOnFunction(llvm::Function & f) override;
+
+protected:
+    /** Lowers one call which is not a constant immediate, buffer is the
+        allocation buffer loaded on entry.  */
+    void lower(llvm::CallInst * ci, llvm::Value * buffer);
+};
+} // namespace rift
+
+#endif //VERSION
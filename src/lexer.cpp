@@ -29,6 +29,10 @@ Token Lexer::identOrKeyword(char start, istream & input) {
         return Token(Token::Type::kwLength);
     else if (x == "type")
         return Token(Token::Type::kwType);
+    else if (x == "gc")
+        return Token(Token::Type::kwGc);
+    else if (x == "gcstats")
+        return Token(Token::Type::kwGcStats);
     else
         return Token(Token::Type::ident, Pool::addToPool(x));
 }
@@ -39,6 +39,8 @@ struct Token {
         kwLength,
         kwEval,
         kwType,
+        kwGc,
+        kwGcStats,
         eof
 
     };
@@ -101,6 +103,10 @@ struct Token {
             return "keyword eval";
         case Type::kwType:
             return "keyword type";
+        case Type::kwGc:
+            return "keyword gc";
+        case Type::kwGcStats:
+            return "keyword gcstats";
         case Type::eof:
             return "EOF";
         default:
@@ -7,6 +7,7 @@
 #include "parser.h"
 #include "runtime.h"
 #include "tests.h"
+#include "bench.h"
 #include "rift.h"
 #include "gc.h"
 
@@ -20,9 +21,25 @@ extern double eval_time;
 
 bool DEBUG = false;
 
+// Heap sizes in megabytes and the gc overhead in percent, the command line
+// overrides them.
+void gcSettingsFromEnv() {
+    if (char const * s = getenv("RIFT_HEAP_SIZE"))
+        gc::GarbageCollector::setHeapSize(atof(s) * 1024 * 1024);
+    if (char const * s = getenv("RIFT_MIN_HEAP_SIZE"))
+        gc::GarbageCollector::setMinHeapSize(atof(s) * 1024 * 1024);
+    if (char const * s = getenv("RIFT_RETAINED_SIZE"))
+        gc::GarbageCollector::setRetainedSize(atof(s) * 1024 * 1024);
+    if (char const * s = getenv("RIFT_GC_OVERHEAD"))
+        gc::GarbageCollector::setGcOverhead(atof(s) / 100);
+}
+
 void interactive() {
-    cout << "rift console - type exit to quit" << endl;
-    Environment * env = Environment::New(nullptr);
+    cout << "rift console - type exit to quit, gcstats for gc statistics, "
+        "cachestats for inline cache statistics" << endl;
+    gc::HandleScope scope;
+    Globals globals;
+    gc::Handle<Environment> env(Environment::NewGlobal(&globals));
     while (not cin.eof()) {
         try {
             cout << "> ";
@@ -36,6 +53,10 @@ void interactive() {
                     in.append("\n");
                 } else {
                     in.append(i);
+                    // Console commands are not Rift code.
+                    if (in == "exit" || in == "gcstats" ||
+                            in == "cachestats")
+                        break;
                     {
                         // Hackish way of supporting multi line input. As long
                         // as the parser cannot parse the input we keep on
@@ -54,6 +75,14 @@ void interactive() {
             }
             if (in == "exit")
                 break;
+            if (in == "gcstats") {
+                gc::GarbageCollector::printStats(cout);
+                continue;
+            }
+            if (in == "cachestats") {
+                EnvCache::printStats(cout);
+                continue;
+            }
             if (in.empty())
                 continue;
             in = in + "\n";
@@ -79,9 +108,14 @@ void runScript(char const * filename) {
     } else {
         Parser p;
         ast::Fun * x = new ast::Fun(p.parse(s));
-        Environment * env = Environment::New(nullptr);
-        auto res = JIT::compile(x)(env);
+        gc::HandleScope scope;
+        Globals globals;
+        gc::Handle<Environment> env(Environment::NewGlobal(&globals));
+        FunPtr f = JIT::compile(x);
+        auto res = f(env);
         res->print(cout);
+        if (DEBUG)
+            EnvCache::printStats(cout);
     }
 
 }
@@ -94,14 +128,51 @@ int main(int argc, char * argv[]) {
 
     // force GC to be initialized:
     Environment::New(nullptr);
+    gcSettingsFromEnv();
 
+    // Flags come before the script and may be given in any order.
     int argPos = 1;
-    if (argc > argPos) {
-        if (0 == strncmp("-d", argv[argPos], 2)) {
+    bool bench = false;
+    for (; argPos < argc && argv[argPos][0] == '-'; ++argPos) {
+        char const * flag = argv[argPos];
+        auto value = [&] () {
+            if (argPos + 1 == argc) {
+                cerr << "Missing value for " << flag << endl;
+                exit(1);
+            }
+            return atof(argv[++argPos]);
+        };
+        if (0 == strcmp("-d", flag)) {
             DEBUG = true;
-            argPos++;
+        } else if (0 == strcmp("-p", flag)) {
+            // Maximal gc pause in milliseconds, 0 disables incremental marking.
+            gc::GarbageCollector::setPauseTarget(value() / 1000);
+        } else if (0 == strcmp("-t", flag)) {
+            // Number of threads marking the heap.
+            gc::GarbageCollector::setMarkThreads(max(1, static_cast<int>(value())));
+        } else if (0 == strcmp("-h", flag)) {
+            // Initial heap limit in megabytes.
+            gc::GarbageCollector::setHeapSize(value() * 1024 * 1024);
+        } else if (0 == strcmp("-r", flag)) {
+            // Megabytes of free pages kept mapped for reuse.
+            gc::GarbageCollector::setRetainedSize(value() * 1024 * 1024);
+        } else if (0 == strcmp("-o", flag)) {
+            // Percentage of the run time to spend in full collections.
+            gc::GarbageCollector::setGcOverhead(value() / 100);
+        } else if (0 == strcmp("-c", flag)) {
+            // Scan the C stack conservatively in addition to the precise roots.
+            gc::GarbageCollector::setConservative(true);
+        } else if (0 == strcmp("-b", flag)) {
+            bench = true;
+        } else {
+            cerr << "Unknown flag " << flag << endl;
+            exit(1);
         }
     }
+    if (bench) {
+        benchmarks();
+        return 0;
+    }
     if (argc == argPos) {
         tests();
         interactive();
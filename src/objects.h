@@ -10,8 +10,9 @@
 template <typename T>
 struct RValOps {
   public:
+    /** Immediates are double vectors, see isImmediate.  */
     static T* Cast(RVal* obj) {
-        if (obj->type != T::TYPE)
+        if (typeOf(obj) != T::TYPE)
             return nullptr;
         return (T*) obj;
     }
@@ -30,6 +31,9 @@ struct RValOps {
     // GC already. Otherwise a GC during object construction will result in an
     // untagged object being scanned. Since defining a constructor on a struct
     // might cause C++ to override the type tag we avoid using them.
+    //
+    // Allocating may move objects. Pointers which are still used afterwards,
+    // including this, have to be kept in a gc::Handle.
     struct AllocPlain {
         T* operator() () const {
             return (T*) gc::GarbageCollector::alloc(sizeof(T), T::TYPE);
@@ -41,6 +45,26 @@ struct RValOps {
                     sizeof(T) + length * T::ELEMENT_SIZE, T::TYPE);
         }
     };
+
+    // Objects of the constant pool are allocated in the permanent space.
+    // They never move and may only point to other permanent objects. All
+    // evaluations share them, so they are never written in place.
+    struct AllocPermanent {
+        T* operator() () const {
+            RVal* obj = gc::GarbageCollector::allocPermanent(
+                    sizeof(T), T::TYPE);
+            obj->named = RVal::SHARED;
+            return (T*) obj;
+        }
+    };
+    struct AllocPermanentVect {
+        T* operator() (unsigned length) const {
+            RVal* obj = gc::GarbageCollector::allocPermanent(
+                    sizeof(T) + length * T::ELEMENT_SIZE, T::TYPE);
+            obj->named = RVal::SHARED;
+            return (T*) obj;
+        }
+    };
 };
 
 /* =================
@@ -82,6 +106,24 @@ struct CharacterVector : RVal, RValOps<CharacterVector> {
         return obj;
     }
 
+    /** Unshared copy, for writing to a shared vector.  */
+    static CharacterVector* Copy(CharacterVector* v) {
+        gc::HandleScope scope;
+        gc::Handle<CharacterVector> from(v);
+        CharacterVector* obj = AllocVect()(from->size+1);
+        obj->size = from->size;
+        memcpy(obj->data, from->data, from->size + 1);
+        return obj;
+    }
+
+    /** String literals of the constant pool. */
+    static CharacterVector* NewPermanent(string const & s) {
+        CharacterVector* obj = AllocPermanentVect()(s.size()+1);
+        obj->size = s.size();
+        memcpy(obj->data, s.c_str(), s.size() + 1);
+        return obj;
+    }
+
     /** Prints to given stream. */
     void print(ostream & s) {
         s << data;
@@ -112,6 +154,8 @@ struct CharacterVector : RVal, RValOps<CharacterVector> {
  *  |  double
  *  |  ...
  * 
+ * Scalars with a small integral value are immediates instead. A
+ * DoubleVector* may be one, sizeOf and elementAt work for both.
  */
 struct DoubleVector : RVal, RValOps<DoubleVector> {
     unsigned size;
@@ -134,6 +178,35 @@ struct DoubleVector : RVal, RValOps<DoubleVector> {
         return obj;
     }
 
+    /** Unshared copy, for writing to a shared vector or an immediate.  */
+    static DoubleVector* Copy(DoubleVector* v) {
+        if (isImmediate(v))
+            return New({immediateValue(v)});
+        gc::HandleScope scope;
+        gc::Handle<DoubleVector> from(v);
+        DoubleVector* obj = AllocVect()(from->size);
+        obj->size = from->size;
+        memcpy(obj->data, from->data, from->size * ELEMENT_SIZE);
+        return obj;
+    }
+
+    /** Scalar result, immediate if possible.  */
+    static RVal* Scalar(double d) {
+        if (fitsImmediate(d))
+            return toImmediate(d);
+        return New({d});
+    }
+
+    static unsigned sizeOf(DoubleVector* v) {
+        return isImmediate(v) ? 1 : v->size;
+    }
+
+    static double elementAt(DoubleVector* v, size_t i) {
+        if (isImmediate(v))
+            return immediateValue(v);
+        return (*v)[i];
+    }
+
     /** Prints to given stream. 
      */
     void print(ostream & s) {
@@ -155,12 +228,11 @@ struct DoubleVector : RVal, RValOps<DoubleVector> {
  *
  */
 struct Bindings : RVal, RValOps<Bindings> {
-    constexpr static size_t growSize = 4;
     constexpr static size_t initialSize = 4;
 
     struct Binding {
         rift::Symbol symbol;
-        RVal * value;
+        gc::HeapRef<RVal> value;
     };
 
     unsigned size;
@@ -191,32 +263,266 @@ struct Bindings : RVal, RValOps<Bindings> {
     
     If the symbol already exists it the environment, updates its value,
     otherwise creates new binding for the symbol and attaches it to the value. 
+    Rebinding the same value does not count as another name for it.
      */
     bool set(rift::Symbol symbol, RVal * value) {
         for (unsigned i = 0; i < size; ++i)
             if (binding[i].symbol == symbol) {
-                binding[i].value = value;
+                update(i, value);
                 return true;
             }
         if (size < available) {
             binding[size].symbol = symbol;
             binding[size].value = value;
+            markNamed(value);
+            gc::GarbageCollector::writeBarrier(this, value);
             size++;
             return true;
         }
         return false;
     }
 
+    /** Assigns value to the existing binding at index, like set.  */
+    void update(unsigned index, RVal * value) {
+        assert(index < size);
+        if (binding[index].value == value)
+            return;
+        binding[index].value = value;
+        markNamed(value);
+        gc::GarbageCollector::writeBarrier(this, value);
+    }
+
+    /** Returns a copy with twice the space, so that adding n bindings
+        copies O(n) of them in total.
+     */
     Bindings* grow() {
-        Bindings* g = Bindings::New(available + growSize);
-        memcpy(g->binding, binding, sizeof(Binding)*size);
-        g->size = size;
+        gc::HandleScope scope;
+        gc::Handle<Bindings> self(this);
+        Bindings* g = Bindings::New(2 * available);
+        memcpy(g->binding, self->binding, sizeof(Binding)*self->size);
+        g->size = self->size;
+        for (unsigned i = 0; i < g->size; ++i)
+            gc::GarbageCollector::writeBarrier(g, g->binding[i].value);
         return g;
     }
 
     Binding binding[];
 };
 
+/*
+ * Variables of the global environment, a hash table of cells. A symbol gets
+ * its cell when it is first bound and the cell keeps its address as long as
+ * the table lives, inline caches refer to it. The table is a root set of
+ * the gc, stores into the cells need no write barrier.
+ *
+ */
+class Globals : public gc::RootSet {
+public:
+    struct Cell {
+        RVal * value;
+        rift::Symbol symbol;
+
+        /** Binds the cell to value, like Bindings::update.  */
+        void set(RVal * v) {
+            if (value == v)
+                return;
+            value = v;
+            markNamed(v);
+        }
+    };
+
+    Globals() : id(++count), table(initialSize, nullptr) {
+        gc::GarbageCollector::addRoots(this);
+    }
+
+    ~Globals() override {
+        gc::GarbageCollector::removeRoots(this);
+    }
+
+    Globals(Globals const &) = delete;
+    void operator= (Globals const &) = delete;
+
+    /** Returns the cell of symbol, nullptr if it was never bound.  */
+    Cell * find(rift::Symbol symbol) {
+        for (size_t i = hash(symbol); ; i = (i + 1) & mask())
+            if (table[i] == nullptr || table[i]->symbol == symbol)
+                return table[i];
+    }
+
+    /** Returns the cell of symbol, a new unbound one the first time.  */
+    Cell * cell(rift::Symbol symbol) {
+        if (Cell * c = find(symbol))
+            return c;
+        // At most half of the table is used, probe sequences stay short.
+        if (2 * (cells.size() + 1) > table.size())
+            rehash(2 * table.size());
+        cells.push_back(Cell{nullptr, symbol});
+        Cell * c = &cells.back();
+        insert(c);
+        return c;
+    }
+
+    void forEachRoot(function<void(RVal**)> const & f) override {
+        for (Cell & c : cells)
+            f(&c.value);
+    }
+
+    /** Tells tables apart, a new one may get the address of an old one.  */
+    unsigned const id;
+
+private:
+    static constexpr size_t initialSize = 64;
+    static atomic<unsigned> count;
+
+    size_t mask() const {
+        return table.size() - 1;
+    }
+
+    size_t hash(rift::Symbol symbol) const {
+        return (symbol * 2654435761u) & mask();
+    }
+
+    void insert(Cell * c) {
+        size_t i = hash(c->symbol);
+        while (table[i])
+            i = (i + 1) & mask();
+        table[i] = c;
+    }
+
+    void rehash(size_t size) {
+        table.assign(size, nullptr);
+        for (Cell & c : cells)
+            insert(&c);
+    }
+
+    /** Cells in the order they were created, deque keeps their address. */
+    deque<Cell> cells;
+    /** Open addressing with linear probing, the size is a power of two. */
+    vector<Cell *> table;
+};
+
+/*
+ * Monomorphic inline cache of a call site looking up a variable by name.
+ *
+ * It remembers where the variable was found the last time: how many parents
+ * up and at which index of the slots or the bindings, or its cell if it is
+ * a global. The environments
+ * passed at a call site have the same layouts, so a hit only has to check
+ * that the symbol is still there and that the bindings in between did not
+ * get it since.
+ *
+ * Several mutators run compiled code and share the caches. An entry is
+ * published under a sequence number, like a seqlock: it is odd while an
+ * entry is written, and a reader which sees it change in between treats
+ * the lookup as a miss. A thread which finds another one filling the cache
+ * leaves it alone.
+ *
+ */
+struct EnvCache {
+    static constexpr int EMPTY = -1;
+
+    struct Entry {
+        /** Parents to walk, EMPTY if nothing is cached.  */
+        int depth;
+        /** Index in the slots if inSlot, in the bindings otherwise.  */
+        unsigned index;
+        bool inSlot;
+        /** Cell in the globals with the given id, instead of index.  */
+        Globals::Cell * cell;
+        unsigned globals;
+    };
+
+    EnvCache() {
+        store(Entry{EMPTY, 0, false, nullptr, 0});
+    }
+
+    EnvCache(EnvCache const &) = delete;
+    void operator= (EnvCache const &) = delete;
+
+    /** Copies the entry to e, returns false if it is empty or being
+        written.
+     */
+    bool load(Entry & e) const {
+        unsigned v = version.load(memory_order_acquire);
+        if (v & 1)
+            return false;
+        e.depth = depth.load(memory_order_relaxed);
+        e.index = index.load(memory_order_relaxed);
+        e.inSlot = inSlot.load(memory_order_relaxed);
+        e.cell = cell.load(memory_order_relaxed);
+        e.globals = globals.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        return version.load(memory_order_relaxed) == v && e.depth != EMPTY;
+    }
+
+    /** Publishes e, unless another thread is writing the cache.  */
+    void store(Entry const & e) {
+        unsigned v = version.load(memory_order_relaxed);
+        if ((v & 1) || !version.compare_exchange_strong(v, v + 1,
+                memory_order_acquire, memory_order_relaxed))
+            return;
+        atomic_thread_fence(memory_order_release);
+        depth.store(e.depth, memory_order_relaxed);
+        index.store(e.index, memory_order_relaxed);
+        inSlot.store(e.inSlot, memory_order_relaxed);
+        cell.store(e.cell, memory_order_relaxed);
+        globals.store(e.globals, memory_order_relaxed);
+        version.store(v + 2, memory_order_release);
+    }
+
+    void clear() {
+        store(Entry{EMPTY, 0, false, nullptr, 0});
+    }
+
+    /** Counts a lookup of any call site, for statistics. Every thread
+        counts on its own, printStats adds them up.
+     */
+    static void hit() {
+        bump(counters().hits);
+    }
+
+    static void miss() {
+        bump(counters().misses);
+    }
+
+    static void printStats(ostream & s);
+
+private:
+    /** Lookups of one thread. Only the thread writes them, others read
+        them while printing the statistics.
+     */
+    struct Counters {
+        atomic<unsigned long> hits{0};
+        atomic<unsigned long> misses{0};
+
+        Counters();
+        ~Counters();
+    };
+
+    static Counters & counters() {
+        static thread_local Counters c;
+        return c;
+    }
+
+    static void bump(atomic<unsigned long> & counter) {
+        counter.store(counter.load(memory_order_relaxed) + 1,
+                memory_order_relaxed);
+    }
+
+    /** Counters of the running threads, and the totals of finished ones. */
+    static mutex countersLock;
+    static vector<Counters *> threadCounters;
+    static unsigned long finishedHits;
+    static unsigned long finishedMisses;
+
+    atomic<unsigned> version{0};
+    atomic<int> depth;
+    atomic<unsigned> index;
+    atomic<bool> inSlot;
+    atomic<Globals::Cell *> cell;
+    atomic<unsigned> globals;
+};
+
 /*
  * Rift Environment. 
  * 
@@ -224,8 +530,13 @@ struct Bindings : RVal, RValOps<Bindings> {
  * the parent environment (i.e. the environment in which the function was
  * declared).
  *
- * The bindings are stored externally because we need to be able to grow
- * them dynamically.
+ * The environment of a call has a fixed slot for every argument and every
+ * variable the function assigns to, allocated together with it. The
+ * compiler accesses those slots directly, a slot without value is not bound
+ * yet. Other variables, created by eval or in environments without a
+ * layout, are stored externally in bindings because we need to be able to
+ * grow them dynamically. The global environment keeps its variables in the
+ * cells of a Globals table instead.
  *
  */
 struct Environment : RVal, RValOps<Environment> {
@@ -233,31 +544,64 @@ struct Environment : RVal, RValOps<Environment> {
 
     Nullptr if top environment. 
      */
-    Environment * parent;
-    Bindings * bindings;
+    gc::HeapRef<Environment> parent;
+    gc::HeapRef<Bindings> bindings;
+    /** Number of fixed slots.  */
+    unsigned size;
+    /** Variables of the global environment, nullptr for all others.  */
+    Globals * globals;
 
     static constexpr Type TYPE = Type::Environment;
+    static constexpr size_t ELEMENT_SIZE = sizeof(Bindings::Binding);
 
     static Environment* New(Environment* parent) {
-        Environment* obj = AllocPlain()();
+        return New(parent, 0, nullptr);
+    }
+
+    /** Creates an environment with a slot for each of the size symbols,
+        which must not move.
+     */
+    static Environment* New(Environment* parent, unsigned size,
+                            rift::Symbol const * symbols) {
+        gc::HandleScope scope;
+        gc::Handle<Environment> p(parent);
+        Environment* obj = AllocVect()(size);
         obj->bindings = nullptr;
-        obj->parent = parent;
+        obj->parent = p;
+        obj->size = size;
+        obj->globals = nullptr;
+        for (unsigned i = 0; i < size; ++i) {
+            obj->slot[i].symbol = symbols[i];
+            obj->slot[i].value = nullptr;
+        }
+        gc::GarbageCollector::writeBarrier(obj, obj->parent);
         return obj;
     }
 
-    static Environment* New(Environment* parent, Bindings* bindings) {
-        Environment* obj = AllocPlain()();
-        obj->bindings = bindings;
-        obj->parent = parent;
+    /** Creates the global environment, its variables live in globals.  */
+    static Environment* NewGlobal(Globals * globals) {
+        Environment* obj = New(nullptr);
+        obj->globals = globals;
         return obj;
     }
 
     RVal * get(rift::Symbol symbol) {
+        for (unsigned i = 0; i < size; ++i)
+            if (slot[i].symbol == symbol) {
+                if (slot[i].value)
+                    return slot[i].value;
+                break;
+            }
         if (bindings) {
             RVal* res = bindings->get(symbol);
             if (res)
                 return res;
         }
+        if (globals) {
+            Globals::Cell * c = globals->find(symbol);
+            if (c && c->value)
+                return c->value;
+        }
 
         if (parent != nullptr)
             return parent->get(symbol);
@@ -271,18 +615,153 @@ struct Environment : RVal, RValOps<Environment> {
     otherwise creates new binding for the symbol and attaches it to the value. 
      */
     void set(rift::Symbol symbol, RVal * value) {
-        if (!bindings)
-            bindings = Bindings::New();
+        for (unsigned i = 0; i < size; ++i)
+            if (slot[i].symbol == symbol) {
+                setSlot(i, value);
+                return;
+            }
+        if (bindings && bindings->set(symbol, value))
+            return;
 
-        if (bindings->set(symbol, value))
+        if (globals) {
+            globals->cell(symbol)->set(value);
             return;
+        }
 
-        bindings = bindings->grow();
+        gc::HandleScope scope;
+        gc::Handle<Environment> self(this);
+        gc::Handle<RVal> val(value);
+        Bindings* b = bindings ? bindings->grow() : Bindings::New();
+        self->bindings = b;
+        gc::GarbageCollector::writeBarrier(self, b);
         bool succ __attribute__((unused)) =
-            bindings->set(symbol, value);
+            b->set(symbol, val);
         assert(succ);
     }
 
+    /** Like get, but starts at the position of the cache and fills it on
+        a miss.
+     */
+    RVal * get(rift::Symbol symbol, EnvCache & cache) {
+        EnvCache::Entry entry;
+        if (cache.load(entry)) {
+            if (RVal * res = cached(symbol, entry)) {
+                EnvCache::hit();
+                return res;
+            }
+        }
+        EnvCache::miss();
+        cache.clear();
+        // An unbound slot may be assigned later, the position found
+        // behind it cannot be cached.
+        bool cacheable = true;
+        int depth = 0;
+        for (Environment * e = this; e != nullptr; e = e->parent, ++depth) {
+            for (unsigned i = 0; i < e->size; ++i)
+                if (e->slot[i].symbol == symbol) {
+                    if (e->slot[i].value) {
+                        if (cacheable)
+                            cache.store({ depth, i, true, nullptr, 0 });
+                        return e->slot[i].value;
+                    }
+                    cacheable = false;
+                    break;
+                }
+            Bindings * b = e->bindings;
+            if (b)
+                for (unsigned i = 0; i < b->size; ++i)
+                    if (b->binding[i].symbol == symbol) {
+                        if (cacheable)
+                            cache.store({ depth, i, false, nullptr, 0 });
+                        return b->binding[i].value;
+                    }
+            if (e->globals) {
+                Globals::Cell * c = e->globals->find(symbol);
+                if (c && c->value) {
+                    if (cacheable)
+                        cache.store({ depth, 0, false, c, e->globals->id });
+                    return c->value;
+                }
+            }
+        }
+        throw "Variable not found";
+    }
+
+    /** Like set, the cache remembers the binding in this environment.  */
+    void set(rift::Symbol symbol, RVal * value, EnvCache & cache) {
+        EnvCache::Entry entry;
+        if (cache.load(entry) && entry.depth == 0 && cached(symbol, entry)) {
+            EnvCache::hit();
+            if (entry.cell)
+                entry.cell->set(value);
+            else if (entry.inSlot)
+                setSlot(entry.index, value);
+            else
+                bindings->update(entry.index, value);
+            return;
+        }
+        EnvCache::miss();
+        gc::HandleScope scope;
+        gc::Handle<Environment> self(this);
+        set(symbol, value);
+        cache.clear();
+        for (unsigned i = 0; i < self->size; ++i)
+            if (self->slot[i].symbol == symbol) {
+                cache.store({ 0, i, true, nullptr, 0 });
+                return;
+            }
+        if (Globals * g = self->globals) {
+            cache.store({ 0, 0, false, g->find(symbol), g->id });
+            return;
+        }
+        Bindings * b = self->bindings;
+        for (unsigned i = 0; i < b->size; ++i)
+            if (b->binding[i].symbol == symbol) {
+                cache.store({ 0, i, false, nullptr, 0 });
+                return;
+            }
+    }
+
+    /** Assigns value to the fixed slot at index, like set.  */
+    void setSlot(unsigned index, RVal * value) {
+        assert(index < size);
+        if (slot[index].value == value)
+            return;
+        slot[index].value = value;
+        markNamed(value);
+        gc::GarbageCollector::writeBarrier(this, value);
+    }
+
+    Bindings::Binding slot[];
+
+private:
+    /** Returns the value at the position of the cache entry, nullptr if
+        the symbol is not bound there or was bound closer since.
+     */
+    RVal * cached(rift::Symbol symbol, EnvCache::Entry const & cache) {
+        Environment * e = this;
+        for (int d = 0; d < cache.depth; ++d) {
+            if (e->bindings && e->bindings->get(symbol))
+                return nullptr;
+            e = e->parent;
+            if (e == nullptr)
+                return nullptr;
+        }
+        if (cache.cell) {
+            if (e->globals && e->globals->id == cache.globals)
+                return cache.cell->value;
+            return nullptr;
+        }
+        if (cache.inSlot) {
+            if (cache.index < e->size && e->slot[cache.index].symbol == symbol)
+                return e->slot[cache.index].value;
+            return nullptr;
+        }
+        Bindings * b = e->bindings;
+        if (b && cache.index < b->size && b->binding[cache.index].symbol == symbol)
+            return b->binding[cache.index].value;
+        return nullptr;
+    }
 };
 
 /*
@@ -293,27 +772,35 @@ struct Environment : RVal, RValOps<Environment> {
 typedef RVal * (*FunPtr)(Environment *);
 
 /*
- * List of formal arguments. Stored externally to be able to share between
- * functions.
+ * Layout of the environment of a call: the formal arguments followed by the
+ * other variables the function assigns to. Stored externally to be able to
+ * share between functions.
  *
  */
 struct FunctionArgs : RVal, RValOps<FunctionArgs> {
     static constexpr Type TYPE = Type::FunctionArgs;
     static constexpr size_t ELEMENT_SIZE = sizeof(rift::Symbol);
 
+    /** Number of arguments.  */
     unsigned length;
+    /** Number of symbols, arguments included.  */
+    unsigned slots;
 
-    static FunctionArgs* New(vector<rift::ast::Var*>& args, unsigned length) {
-        FunctionArgs* obj = AllocVect()(length);
-        unsigned i = 0;
+    /** Argument lists belong to functions of the constant pool and are
+        permanent as well.
+     */
+    static FunctionArgs* New(vector<rift::Symbol> const & layout,
+                             unsigned length) {
+        FunctionArgs* obj = AllocPermanentVect()(layout.size());
         obj->length = length;
-        for (rift::ast::Var * arg : args)
-            (*obj)[i++] = arg->symbol;
+        obj->slots = layout.size();
+        for (unsigned i = 0; i < layout.size(); ++i)
+            obj->symbol[i] = layout[i];
         return obj;
     }
 
     rift::Symbol& operator[] (const size_t i) {
-        assert (i < length);
+        assert (i < slots);
         return symbol[i];
     }
 
@@ -329,31 +816,40 @@ struct FunctionArgs : RVal, RValOps<FunctionArgs> {
  *
  */
 struct RFun : RVal, RValOps<RFun> {
-    Environment * env;
+    gc::HeapRef<Environment> env;
     FunPtr code;
     llvm::Function * bitcode;
-    FunctionArgs * args;
+    gc::HeapRef<FunctionArgs> args;
     
     static constexpr Type TYPE = Type::Function;
 
-    static RFun* New(rift::ast::Fun * fun, llvm::Function * bitcode) {
-        RFun* obj = AllocPlain()();
+    /** Creates a function of the constant pool, without environment. It
+        lives in the permanent space, closures are copies of it. The layout
+        starts with the arguments of fun.
+     */
+    static RFun* New(rift::ast::Fun * fun, llvm::Function * bitcode,
+                     vector<rift::Symbol> const & layout) {
+        assert(layout.size() >= fun->args.size());
+        RFun* obj = AllocPermanent()();
         obj->env = nullptr;
         obj->code = nullptr;
         obj->bitcode = bitcode;
         obj->args = nullptr;
-        if (fun->args.size() > 0) {
-            obj->args = FunctionArgs::New(fun->args, fun->args.size());
-        }
+        if (layout.size() > 0)
+            obj->args = FunctionArgs::New(layout, fun->args.size());
         return obj;
     }
 
-    static RFun* Copy(RFun* fun) {
+    static RFun* Copy(RFun* f) {
+        gc::HandleScope scope;
+        gc::Handle<RFun> fun(f);
         RFun* obj = AllocPlain()();
         obj->env = fun->env;
         obj->code = fun->code;
         obj->bitcode = fun->bitcode;
         obj->args = fun->args;
+        gc::GarbageCollector::writeBarrier(obj, obj->env);
+        gc::GarbageCollector::writeBarrier(obj, obj->args);
         return obj;
     }
 
@@ -367,8 +863,11 @@ struct RFun : RVal, RValOps<RFun> {
      */
     RFun* close(Environment * e) {
         assert(!env);
+        gc::HandleScope scope;
+        gc::Handle<Environment> closureEnv(e);
         RFun* closure = Copy(this);
-        closure->env = e;
+        closure->env = closureEnv;
+        gc::GarbageCollector::writeBarrier(closure, closure->env);
         return closure;
     }
   
@@ -382,7 +881,8 @@ struct RFun : RVal, RValOps<RFun> {
 
 /** Prints to given stream.  */
 void RVal::print(ostream & s) {
-         if (auto d = DoubleVector::Cast(this))    d->print(s);
+         if (isImmediate(this))                    s << immediateValue(this) << " ";
+    else if (auto d = DoubleVector::Cast(this))    d->print(s);
     else if (auto c = CharacterVector::Cast(this)) c->print(s);
     else if (auto f = RFun::Cast(this))            f->print(s);
     else assert(false);
@@ -61,11 +61,13 @@ namespace rift {
             CALL ::= '(' [ EXPRESSION {, EXPRESSION } ')'
             INDEX ::= '[' EXPRESSION ']' [ ASSIGNMENT ]
             ASSIGNMENT ::= ( <- | = ) EXPRESSION
-            SPECIAL_CALL ::= EVAL | LENGTH | TYPE | C
+            SPECIAL_CALL ::= EVAL | LENGTH | TYPE | C | GC | GCSTATS
             EVAL ::= eval '(' EXPRESSION ')'
             LENGTH ::= length '(' EXPRESSION ')'
             TYPE ::= type '(' EXPRESSION ')'
             C ::= c '(' EXPRESSION {, EXPRESSION } ')'
+            GC ::= gc '(' ')'
+            GCSTATS ::= gcstats '(' ')'
             FUNCTION ::= function '(' [ ident {, ident } ] ')' SEQ
             WHILE ::= while '(' EXPRESSION ')' SEQ
             IF ::= if '(' EXPRESSION ')' SEQ [ else SEQ ]
@@ -144,6 +146,20 @@ namespace rift {
             return result.release();
         }
 
+        ast::Exp * parseGc() {
+            pop(Token::Type::kwGc);
+            pop(Token::Type::opar);
+            pop(Token::Type::cpar);
+            return new ast::GcCall();
+        }
+
+        ast::Exp * parseGcStats() {
+            pop(Token::Type::kwGcStats);
+            pop(Token::Type::opar);
+            pop(Token::Type::cpar);
+            return new ast::GcStatsCall();
+        }
+
         ast::Exp * parseF() {
             switch (top().type) {
                 case Token::Type::ident:
@@ -168,6 +184,10 @@ namespace rift {
                     return parseType();
                 case Token::Type::kwC:
                     return parseC();
+                case Token::Type::kwGc:
+                    return parseGc();
+                case Token::Type::kwGcStats:
+                    return parseGcStats();
                 default:
                     throw "literal, variable, call or special call expected";
             }
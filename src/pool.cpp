@@ -2,7 +2,9 @@
 
 namespace rift {
 
-vector<RFun *> Pool::f_;
+deque<RFun *> Pool::f_;
 vector<string> Pool::pool_;
+vector<CharacterVector *> Pool::literals_;
+deque<EnvCache> Pool::caches_;
 
 }
@@ -18,18 +18,42 @@ public:
         return f_[index];
     }
 
-    /** Adds function to compiled functions, returns its index.     */
-    static int addFunction(ast::Fun * fun, llvm::Function * bitcode) {
-        RFun * f = RFun::New(fun, bitcode);
+    /** Adds function to compiled functions, returns its index. The layout
+        lists the slots of its environments, see Layout. Functions are
+        permanent, the GC does not need to know about f_.
+     */
+    static int addFunction(ast::Fun * fun, llvm::Function * bitcode,
+            vector<Symbol> const & layout = vector<Symbol>()) {
+        RFun * f = RFun::New(fun, bitcode, layout);
         f_.push_back(f);
         return f_.size() - 1;
     }
 
+    /** Returns a new empty inline cache. Caches stay at their address,
+        compiled code refers to them.
+     */
+    static EnvCache * addCache() {
+        caches_.emplace_back();
+        return &caches_.back();
+    }
+
     /** Returns string at index.  */
     static string const & getPoolObject(unsigned index) {
         return pool_[index];
     }
 
+    /** Returns the string at index as a permanent character vector. It is
+        created when the string is first used as a literal.
+     */
+    static CharacterVector * getLiteral(unsigned index) {
+        if (literals_.size() <= index)
+            literals_.resize(pool_.size(), nullptr);
+        CharacterVector *& literal = literals_[index];
+        if (!literal)
+            literal = CharacterVector::NewPermanent(pool_[index]);
+        return literal;
+    }
+
     /** Adds string to the constant pool.  */
     static int addToPool(string const & s) {
         for (unsigned i = 0; i < pool_.size(); ++i)
@@ -41,10 +65,16 @@ public:
 
 private:
     /** Compiled functions.   */
-    static vector<RFun *> f_;
+    static deque<RFun *> f_;
 
     /** Strings.  */
     static vector<string> pool_;
+
+    /** Inline caches of all call sites.  */
+    static deque<EnvCache> caches_;
+
+    /** Strings used as literals, indexed like pool_.  */
+    static vector<CharacterVector *> literals_;
 };
 
 }
@@ -19,8 +19,81 @@ using namespace rift;
 
 double eval_time;
 
+mutex EnvCache::countersLock;
+vector<EnvCache::Counters *> EnvCache::threadCounters;
+unsigned long EnvCache::finishedHits = 0;
+unsigned long EnvCache::finishedMisses = 0;
+
+EnvCache::Counters::Counters() {
+    lock_guard<mutex> lock(countersLock);
+    threadCounters.push_back(this);
+}
+
+EnvCache::Counters::~Counters() {
+    lock_guard<mutex> lock(countersLock);
+    finishedHits += hits.load(memory_order_relaxed);
+    finishedMisses += misses.load(memory_order_relaxed);
+    threadCounters.erase(find(threadCounters.begin(), threadCounters.end(),
+            this));
+}
+
+void EnvCache::printStats(ostream & s) {
+    unsigned long hits, misses;
+    {
+        lock_guard<mutex> lock(countersLock);
+        hits = finishedHits;
+        misses = finishedMisses;
+        for (Counters * c : threadCounters) {
+            hits += c->hits.load(memory_order_relaxed);
+            misses += c->misses.load(memory_order_relaxed);
+        }
+    }
+    s << "inline cache hits:   " << hits << endl;
+    s << "inline cache misses: " << misses << endl;
+}
+atomic<unsigned> Globals::count(0);
+
+namespace {
+
+/** Applies op to the elements of two double vectors, the shorter one is
+    recycled. Scalars do not allocate if the result is an immediate.  */
+template <typename OP>
+RVal * doubleBinary(DoubleVector * l, DoubleVector * r, OP op) {
+    unsigned lsize = DoubleVector::sizeOf(l);
+    unsigned rsize = DoubleVector::sizeOf(r);
+    if (lsize == 1 and rsize == 1)
+        return DoubleVector::Scalar(op(DoubleVector::elementAt(l, 0),
+                                       DoubleVector::elementAt(r, 0)));
+    gc::HandleScope scope;
+    gc::Handle<DoubleVector> lhs(l), rhs(r);
+    unsigned resultSize = max(lsize, rsize);
+    DoubleVector* result = DoubleVector::New(resultSize);
+    for (unsigned i = 0; i < resultSize; ++i)
+        (*result)[i] = op(DoubleVector::elementAt(lhs, i % lsize),
+                          DoubleVector::elementAt(rhs, i % rsize));
+    return result;
+}
+
+} // namespace
+
 extern "C" {
 
+RVal ** gcEnterFrame(int slots) {
+    return gc::GarbageCollector::enterFrame(slots);
+}
+
+void gcLeaveFrame(RVal ** frame) {
+    gc::GarbageCollector::leaveFrame(frame);
+}
+
+gc::AllocationBuffer * gcAllocBuffer() {
+    return gc::GarbageCollector::allocationBuffer();
+}
+
+void gcSafepoint() {
+    gc::GarbageCollector::safepoint();
+}
+
 Environment * envCreate(Environment * parent) {
     return Environment::New(parent);
 }
@@ -33,37 +106,54 @@ void envSet(Environment * env, int symbol, RVal * RVal) {
     env->set(symbol, RVal);
 }
 
+RVal * envGetCached(Environment * env, int symbol, EnvCache * cache) {
+    return env->get(symbol, *cache);
+}
+
+void envSetCached(Environment * env, int symbol, RVal * RVal,
+        EnvCache * cache) {
+    env->set(symbol, RVal, *cache);
+}
+
+void envSetSlot(Environment * env, int slot, RVal * RVal) {
+    env->setSlot(slot, RVal);
+}
+
 RVal * doubleVectorLiteral(double RVal) {
-    return DoubleVector::New({RVal});
+    return DoubleVector::Scalar(RVal);
 }
 
 RVal * characterVectorLiteral(int cpIndex) {
-    string const & original = Pool::getPoolObject(cpIndex);
-    return CharacterVector::New(original.c_str());
-
+    // The literal is shared, it is copied on the first write.
+    return Pool::getLiteral(cpIndex);
 }
 
 double scalarFromVector(DoubleVector * v) {
-    if (v->size != 1)
+    if (DoubleVector::sizeOf(v) != 1)
         throw "not a scalar";
-    return (*v)[0];
+    return DoubleVector::elementAt(v, 0);
 }
 
 double doubleGetSingleElement(DoubleVector * from, double index) {
-    if (index < 0 or index >= from->size)
+    if (index < 0 or index >= DoubleVector::sizeOf(from))
         throw "Index out of bounds";
-    return (*from)[static_cast<unsigned>(index)];
+    return DoubleVector::elementAt(from, static_cast<unsigned>(index));
 }
 
-RVal * doubleGetElement(DoubleVector * from, DoubleVector * index) {
+RVal * doubleGetElement(DoubleVector * source, DoubleVector * indices) {
 #if VERSION >= 3 
-    unsigned resultSize = index->size;
+    unsigned resultSize = DoubleVector::sizeOf(indices);
+    if (resultSize == 1)
+        return DoubleVector::Scalar(doubleGetSingleElement(
+                source, DoubleVector::elementAt(indices, 0)));
+    gc::HandleScope scope;
+    gc::Handle<DoubleVector> from(source), index(indices);
     DoubleVector* result = DoubleVector::New(resultSize);
     for (unsigned i = 0; i < resultSize; ++i) {
-        double idx = (*index)[i];
-        if (idx < 0 or idx >= from->size)
+        double idx = DoubleVector::elementAt(index, i);
+        if (idx < 0 or idx >= DoubleVector::sizeOf(from))
             throw "Index out of bounds";
-        (*result)[i] = (*from)[static_cast<int>(idx)];
+        (*result)[i] = DoubleVector::elementAt(from, static_cast<int>(idx));
     }
     return result;
 #endif //VERSION
@@ -73,11 +163,14 @@ RVal * doubleGetElement(DoubleVector * from, DoubleVector * index) {
 #endif //VERSION
 }
 
-RVal * characterGetElement(CharacterVector * from, DoubleVector * index) {
-    unsigned resultSize = index->size;
+RVal * characterGetElement(CharacterVector * source, DoubleVector * indices) {
+    gc::HandleScope scope;
+    gc::Handle<CharacterVector> from(source);
+    gc::Handle<DoubleVector> index(indices);
+    unsigned resultSize = DoubleVector::sizeOf(index);
     CharacterVector* result = CharacterVector::New(resultSize);
     for (unsigned i = 0; i < resultSize; ++i) {
-        double idx = (*index)[i];
+        double idx = DoubleVector::elementAt(index, i);
         if (idx < 0 or idx >= from->size)
             throw "Index out of bounds";
         (*result)[i] = (*from)[static_cast<int>(idx)];
@@ -98,24 +191,26 @@ RVal * genericGetElement(RVal * from, RVal * index) {
 }
 
 void doubleSetElement(DoubleVector * target, DoubleVector * index, DoubleVector * RVal) {
-    for (unsigned i = 0; i < index->size; ++i) {
-        double idx = (*index)[i];
+    assert(!isImmediate(target));
+    for (unsigned i = 0; i < DoubleVector::sizeOf(index); ++i) {
+        double idx = DoubleVector::elementAt(index, i);
         if (idx < 0 or idx >= target->size)
             throw "Index out of bound";
-        double val = (*RVal)[i % RVal->size];
+        double val = DoubleVector::elementAt(RVal, i % DoubleVector::sizeOf(RVal));
         (*target)[static_cast<int>(idx)] = val;
     }
 }
 
 void scalarSetElement(DoubleVector * target, double index, double RVal) {
+    assert(!isImmediate(target));
     if (index < 0 or index >= target->size)
         throw "Index out of bound";
     (*target)[static_cast<int>(index)] = RVal;
 }
 
 void characterSetElement(CharacterVector * target, DoubleVector * index, CharacterVector * RVal) {
-    for (unsigned i = 0; i < index->size; ++i) {
-        double  idx = (*index)[i];
+    for (unsigned i = 0; i < DoubleVector::sizeOf(index); ++i) {
+        double  idx = DoubleVector::elementAt(index, i);
         if (idx < 0 or idx >= target->size)
             throw "Index out of bound";
         char val = (*RVal)[i % RVal->size];
@@ -123,29 +218,39 @@ void characterSetElement(CharacterVector * target, DoubleVector * index, Charact
     }
 }
 
-void genericSetElement(RVal * target, RVal * index, RVal * value) {
+/* Only doubles and characters are stored into the target, so no write
+   barrier is needed here. Shared vectors and immediates cannot be updated in
+   place, they are copied and the copy is returned. */
+RVal * genericSetElement(RVal * target, RVal * index, RVal * value) {
     auto i = DoubleVector::Cast(index);
     if (!i) throw "Index vector must be double";
-    if (target->type != value->type)
+    if (typeOf(target) != typeOf(value))
         throw "Vector and element must be of same type";
+    gc::HandleScope scope;
+    gc::Handle<DoubleVector> idx(i);
+    gc::Handle<RVal> val(value);
     if (auto t = DoubleVector::Cast(target)) {
-        doubleSetElement(t, i, static_cast<DoubleVector*>(value));
+        if (isImmediate(t) or isShared(t))
+            t = DoubleVector::Copy(t);
+        doubleSetElement(t, idx, static_cast<DoubleVector*>(val.get()));
+        return t;
     } else if (auto t = CharacterVector::Cast(target)) {
-        characterSetElement(t, i, static_cast<CharacterVector*>(value));
+        if (isShared(t))
+            t = CharacterVector::Copy(t);
+        characterSetElement(t, idx, static_cast<CharacterVector*>(val.get()));
+        return t;
     } else {
         throw "Cannot index a function";
     }
 }
 
-RVal * doubleAdd(DoubleVector * lhs, DoubleVector * rhs) {
-    int resultSize = max(lhs->size, rhs->size);
-    DoubleVector* res = DoubleVector::New(resultSize);
-    for (int i = 0; i < resultSize; ++i)
-        (*res)[i] = (*lhs)[i % lhs->size] + (*rhs)[i % rhs->size];
-    return res;
+RVal * doubleAdd(DoubleVector * l, DoubleVector * r) {
+    return doubleBinary(l, r, [] (double a, double b) { return a + b; });
 }
 
-RVal * characterAdd(CharacterVector * lhs, CharacterVector * rhs) {
+RVal * characterAdd(CharacterVector * l, CharacterVector * r) {
+    gc::HandleScope scope;
+    gc::Handle<CharacterVector> lhs(l), rhs(r);
     int resultSize = lhs->size + rhs->size;
     CharacterVector* result = CharacterVector::New(resultSize);
     memcpy(result->data, lhs->data, lhs->size);
@@ -155,7 +260,7 @@ RVal * characterAdd(CharacterVector * lhs, CharacterVector * rhs) {
 
 
 RVal * genericAdd(RVal * lhs, RVal * rhs) {
-    if (lhs->type != rhs->type)
+    if (typeOf(lhs) != typeOf(rhs))
         throw "Incompatible types for binary operator";
     if (auto l = DoubleVector::Cast(lhs)) {
         return doubleAdd(l, static_cast<DoubleVector*>(rhs));
@@ -166,13 +271,9 @@ RVal * genericAdd(RVal * lhs, RVal * rhs) {
     }
 }
 
-RVal * doubleSub(DoubleVector * lhs, DoubleVector * rhs) {
+RVal * doubleSub(DoubleVector * l, DoubleVector * r) {
 #if VERSION >= 3
-    int resultSize = max(lhs->size, rhs->size);
-    DoubleVector* result = DoubleVector::New(resultSize);
-    for (int i = 0; i < resultSize; ++i)
-        (*result)[i] = (*lhs)[i % lhs->size] - (*rhs)[i % rhs->size];
-    return result;
+    return doubleBinary(l, r, [] (double a, double b) { return a - b; });
 #endif //VERSION
 #if VERSION < 3
     // TODO
@@ -198,12 +299,8 @@ RVal * genericSub(RVal * lhs, RVal * rhs) {
 #endif //VERSION
 }
 
-RVal * doubleMul(DoubleVector * lhs, DoubleVector * rhs) {
-    int resultSize = max(lhs->size, rhs->size);
-    DoubleVector* result = DoubleVector::New(resultSize);
-    for (int i = 0; i < resultSize; ++i)
-        (*result)[i] = (*lhs)[i % lhs->size] * (*rhs)[i % rhs->size];
-    return result;
+RVal * doubleMul(DoubleVector * l, DoubleVector * r) {
+    return doubleBinary(l, r, [] (double a, double b) { return a * b; });
 }
 
 RVal * genericMul(RVal * lhs, RVal * rhs) {
@@ -214,12 +311,8 @@ RVal * genericMul(RVal * lhs, RVal * rhs) {
     return doubleMul(l, r);
 }
 
-RVal * doubleDiv(DoubleVector * lhs, DoubleVector * rhs) {
-    int resultSize = max(lhs->size, rhs->size);
-    DoubleVector* result = DoubleVector::New(resultSize);
-    for (int i = 0; i < resultSize; ++i)
-        (*result)[i] = (*lhs)[i % lhs->size] / (*rhs)[i % rhs->size];
-    return result;
+RVal * doubleDiv(DoubleVector * l, DoubleVector * r) {
+    return doubleBinary(l, r, [] (double a, double b) { return a / b; });
 }
 
 RVal * genericDiv(RVal * lhs, RVal * rhs) {
@@ -230,15 +323,13 @@ RVal * genericDiv(RVal * lhs, RVal * rhs) {
     return doubleDiv(l, r);
 }
 
-RVal * doubleEq(DoubleVector * lhs, DoubleVector * rhs) {
-    int resultSize = max(lhs->size, rhs->size);
-    DoubleVector* result = DoubleVector::New(resultSize);
-    for (int i = 0; i < resultSize; ++i)
-        (*result)[i] = (*lhs)[i % lhs->size] == (*rhs)[i % rhs->size];
-    return result;
+RVal * doubleEq(DoubleVector * l, DoubleVector * r) {
+    return doubleBinary(l, r, [] (double a, double b) -> double { return a == b; });
 }
 
-RVal * characterEq(CharacterVector * lhs, CharacterVector * rhs) {
+RVal * characterEq(CharacterVector * l, CharacterVector * r) {
+    gc::HandleScope scope;
+    gc::Handle<CharacterVector> lhs(l), rhs(r);
     int resultSize = max(lhs->size, rhs->size);
     DoubleVector* result = DoubleVector::New(resultSize);
     for (int i = 0; i < resultSize; ++i)
@@ -247,30 +338,27 @@ RVal * characterEq(CharacterVector * lhs, CharacterVector * rhs) {
 }
 
 RVal * genericEq(RVal * lhs, RVal * rhs) {
-    if (lhs->type != rhs->type)
-        return DoubleVector::New({0});
+    if (typeOf(lhs) != typeOf(rhs))
+        return toImmediate(0);
 
     if (auto l = DoubleVector::Cast(lhs))
         return doubleEq(l, static_cast<DoubleVector*>(rhs));
     if (auto l = CharacterVector::Cast(lhs))
         return characterEq(l, static_cast<CharacterVector*>(rhs));
     if (auto l = RFun::Cast(lhs))
-        return DoubleVector::New(
-                {static_cast<double>(l->code == static_cast<RFun*>(rhs)->code)});
+        return toImmediate(l->code == static_cast<RFun*>(rhs)->code);
 
     assert(false);
     return nullptr;
 }
 
-RVal * doubleNeq(DoubleVector * lhs, DoubleVector * rhs) {
-    int resultSize = max(lhs->size, rhs->size);
-    DoubleVector* result = DoubleVector::New(resultSize);
-    for (int i = 0; i < resultSize; ++i)
-        (*result)[i] = (*lhs)[i % lhs->size] != (*rhs)[i % rhs->size];
-    return result;
+RVal * doubleNeq(DoubleVector * l, DoubleVector * r) {
+    return doubleBinary(l, r, [] (double a, double b) -> double { return a != b; });
 }
 
-RVal * characterNeq(CharacterVector * lhs, CharacterVector * rhs) {
+RVal * characterNeq(CharacterVector * l, CharacterVector * r) {
+    gc::HandleScope scope;
+    gc::Handle<CharacterVector> lhs(l), rhs(r);
     int resultSize = max(lhs->size, rhs->size);
     DoubleVector* result = DoubleVector::New(resultSize);
     for (int i = 0; i < resultSize; ++i)
@@ -279,27 +367,22 @@ RVal * characterNeq(CharacterVector * lhs, CharacterVector * rhs) {
 }
 
 RVal * genericNeq(RVal * lhs, RVal * rhs) {
-    if (lhs->type != rhs->type)
-        return DoubleVector::New({1});
+    if (typeOf(lhs) != typeOf(rhs))
+        return toImmediate(1);
 
     if (auto l = DoubleVector::Cast(lhs))
         return doubleNeq(l, static_cast<DoubleVector*>(rhs));
     if (auto l = CharacterVector::Cast(lhs))
         return characterNeq(l, static_cast<CharacterVector*>(rhs));
     if (auto l = RFun::Cast(lhs))
-        return DoubleVector::New(
-                {static_cast<double>(l->code != static_cast<RFun*>(rhs)->code)});
+        return toImmediate(l->code != static_cast<RFun*>(rhs)->code);
 
     assert(false);
     return nullptr;
 }
 
-RVal * doubleLt(DoubleVector * lhs, DoubleVector * rhs) {
-    int resultSize = max(lhs->size, rhs->size);
-    DoubleVector* result = DoubleVector::New(resultSize);
-    for (int i = 0; i < resultSize; ++i)
-        (*result)[i] = (*lhs)[i % lhs->size] < (*rhs)[i % rhs->size];
-    return result;
+RVal * doubleLt(DoubleVector * l, DoubleVector * r) {
+    return doubleBinary(l, r, [] (double a, double b) -> double { return a < b; });
 }
 
 RVal * genericLt(RVal * lhs, RVal * rhs) {
@@ -311,12 +394,8 @@ RVal * genericLt(RVal * lhs, RVal * rhs) {
     return doubleLt(l, r);
 }
 
-RVal * doubleGt(DoubleVector * lhs, DoubleVector * rhs) {
-    int resultSize = max(lhs->size, rhs->size);
-    DoubleVector* result = DoubleVector::New(resultSize);
-    for (int i = 0; i < resultSize; ++i)
-        (*result)[i] = (*lhs)[i % lhs->size] > (*rhs)[i % rhs->size];
-    return result;
+RVal * doubleGt(DoubleVector * l, DoubleVector * r) {
+    return doubleBinary(l, r, [] (double a, double b) -> double { return a > b; });
 }
 
 
@@ -338,7 +417,8 @@ bool toBoolean(RVal * v) {
     } else if (auto c = CharacterVector::Cast(v)) {
         return (c->size > 0) and ((*c)[0] != 0);
     } else if (auto d = DoubleVector::Cast(v)) {
-        return (d->size > 0) and ((*d)[0] != 0);
+        return (DoubleVector::sizeOf(d) > 0) and
+            (DoubleVector::elementAt(d, 0) != 0);
     }
 
     assert(false);
@@ -346,30 +426,35 @@ bool toBoolean(RVal * v) {
 }
 
 RVal * call(RVal * callee, unsigned argc, ...) {
-    auto f = RFun::Cast(callee);
-    if (!f) throw "Not a function!";
+    if (!RFun::Cast(callee)) throw "Not a function!";
 
+    gc::HandleScope scope;
+    gc::Handle<RFun> f(static_cast<RFun*>(callee));
     if (f->nargs() != argc) throw "Wrong number of arguments";
 
-    Bindings * calleeBindings = Bindings::New(argc);
+    // The arguments have to survive allocating the environment.
+    RVal ** values = scope.slots(argc);
     va_list ap;
     va_start(ap, argc);
-    for (unsigned i = 0; i < argc; ++i) {
-        // TODO this is pass by reference always!
-        auto name = (*f->args)[i];
-        auto value = va_arg(ap, RVal*);
-        calleeBindings->binding[i].symbol = name;
-        calleeBindings->binding[i].value = value;
-    }
-    calleeBindings->size = argc;
+    for (unsigned i = 0; i < argc; ++i)
+        values[i] = va_arg(ap, RVal*);
     va_end(ap);
-    Environment * calleeEnv = Environment::New(f->env, calleeBindings);
+
+    // The arguments are the first slots of the layout, the other
+    // variables are bound when the function assigns to them.
+    FunctionArgs * layout = f->args;
+    Environment * calleeEnv = layout ?
+        Environment::New(f->env, layout->slots, layout->symbol) :
+        Environment::New(f->env);
+    for (unsigned i = 0; i < argc; ++i)
+        // passed by reference, a write copies the vector once it is shared
+        calleeEnv->setSlot(i, values[i]);
     return f->code(calleeEnv);
 }
 
 double length(RVal * v) {
     if (auto d = DoubleVector::Cast(v))
-        return d->size;
+        return DoubleVector::sizeOf(d);
     if (auto c = CharacterVector::Cast(v))
         return c->size;
 
@@ -379,7 +464,7 @@ double length(RVal * v) {
 }
 
 RVal * type(RVal * v) {
-    switch (v->type) {
+    switch (typeOf(v)) {
     case Type::Double:
         return CharacterVector::New("double");
     case Type::Character:
@@ -391,12 +476,15 @@ RVal * type(RVal * v) {
     }
 }
 
-RVal * eval(Environment * env, char const * value) {
+RVal * eval(Environment * e, char const * value) {
+    // Also unwinds the shadow stack if an error is thrown.
+    gc::HandleScope scope;
+    gc::Handle<Environment> env(e);
     string s(value);
     Parser p;
     ast::Fun * x = new ast::Fun(p.parse(s));
     if (x->body->body.empty())
-        return DoubleVector::New({0});
+        return toImmediate(0);
 
     if (DEBUG) {
         cout << "AST:" << endl;
@@ -428,37 +516,46 @@ RVal * genericEval(Environment * env, RVal * arg) {
 }
 
 RVal * doublec(int size, ...) {
-    vector<DoubleVector *> args;
+    gc::HandleScope scope;
+    RVal ** args = scope.slots(size);
     va_list ap;
     va_start(ap, size);
     for (int i = 0; i < size; ++i)
-        args.push_back(va_arg(ap, DoubleVector*));
+        args[i] = va_arg(ap, DoubleVector*);
     va_end(ap);
+    int argc = size;
     size = 0;
-    for (DoubleVector * v : args)
-        size += v->size;
+    for (int i = 0; i < argc; ++i)
+        size += DoubleVector::sizeOf(static_cast<DoubleVector*>(args[i]));
     DoubleVector* result = DoubleVector::New(size);
     int offset = 0;
-    for (DoubleVector * v : args) {
-        memcpy(result->data + offset, v->data, v->size * sizeof(double));
-        offset += v->size;
+    for (int i = 0; i < argc; ++i) {
+        auto v = static_cast<DoubleVector*>(args[i]);
+        if (isImmediate(v))
+            result->data[offset] = immediateValue(v);
+        else
+            memcpy(result->data + offset, v->data, v->size * sizeof(double));
+        offset += DoubleVector::sizeOf(v);
     }
     return result;
 }
 
 RVal * characterc(int size, ...) {
-    vector<CharacterVector *> args;
+    gc::HandleScope scope;
+    RVal ** args = scope.slots(size);
     va_list ap;
     va_start(ap, size);
     for (int i = 0; i < size; ++i)
-        args.push_back(va_arg(ap, CharacterVector*));
+        args[i] = va_arg(ap, CharacterVector*);
     va_end(ap);
+    int argc = size;
     size = 0;
-    for (CharacterVector * v : args)
-        size += v->size;
+    for (int i = 0; i < argc; ++i)
+        size += static_cast<CharacterVector*>(args[i])->size;
     CharacterVector * result = CharacterVector::New(size);
     int offset = 0;
-    for (CharacterVector * v : args) {
+    for (int i = 0; i < argc; ++i) {
+        auto v = static_cast<CharacterVector*>(args[i]);
         memcpy(result->data + offset, v->data, v->size * sizeof(char));
         offset += v->size;
     }
@@ -468,46 +565,51 @@ RVal * characterc(int size, ...) {
 RVal * c(int size, ...) {
     if (size == 0)
         return DoubleVector::New({});
-    vector<RVal *> args;
+    gc::HandleScope scope;
+    RVal ** args = scope.slots(size);
     va_list ap;
     va_start(ap, size);
     for (int i = 0; i < size; ++i)
-        args.push_back(va_arg(ap, RVal*));
+        args[i] = va_arg(ap, RVal*);
     va_end(ap);
+    unsigned argc = size;
 
-    Type t = args[0]->type;
+    Type t = typeOf(args[0]);
     if (t == Type::Function)
         throw "Cannot concatenate functions";
 
-    for (unsigned i = 1; i < args.size(); ++i) {
-        if (args[i]->type != t)
+    for (unsigned i = 1; i < argc; ++i) {
+        if (typeOf(args[i]) != t)
             throw "Types of all c arguments must be the same";
     }
 
     if (t == Type::Double) {
         size_t size = 0;
-        for (RVal * v : args) {
-            auto d = static_cast<DoubleVector*>(v);
-            size += d->size;
+        for (unsigned i = 0; i < argc; ++i) {
+            auto d = static_cast<DoubleVector*>(args[i]);
+            size += DoubleVector::sizeOf(d);
         }
         DoubleVector* result = DoubleVector::New(size);
         unsigned offset = 0;
-        for (RVal * v : args) {
-            auto d = static_cast<DoubleVector*>(v);
-            memcpy(result->data + offset, d->data, d->size * sizeof(double));
-            offset += d->size;
+        for (unsigned i = 0; i < argc; ++i) {
+            auto d = static_cast<DoubleVector*>(args[i]);
+            if (isImmediate(d))
+                result->data[offset] = immediateValue(d);
+            else
+                memcpy(result->data + offset, d->data, d->size * sizeof(double));
+            offset += DoubleVector::sizeOf(d);
         }
         return result;
     } else { // Character
         size_t size = 0;
-        for (RVal * v : args) {
-            auto c = static_cast<CharacterVector*>(v);
+        for (unsigned i = 0; i < argc; ++i) {
+            auto c = static_cast<CharacterVector*>(args[i]);
             size += c->size;
         }
         CharacterVector * result = CharacterVector::New(size);
         unsigned offset = 0;
-        for (RVal * v : args) {
-            auto c = static_cast<CharacterVector*>(v);
+        for (unsigned i = 0; i < argc; ++i) {
+            auto c = static_cast<CharacterVector*>(args[i]);
             memcpy(result->data + offset, c->data, c->size * sizeof(char));
             offset += c->size;
         }
@@ -515,4 +617,30 @@ RVal * c(int size, ...) {
     }
 }
 
+RVal * gcStats() {
+    gc::GarbageCollector::Stats s = gc::GarbageCollector::stats();
+    double values[] = {
+        static_cast<double>(s.minor.count),
+        static_cast<double>(s.collections),
+        s.minor.total + s.major.total,
+        max(s.minor.max, s.major.max),
+        static_cast<double>(s.heapSize),
+        static_cast<double>(s.heapLimit),
+        static_cast<double>(s.allocated.total()),
+        static_cast<double>(s.freed.total()),
+        static_cast<double>(s.arenaPages),
+        static_cast<double>(s.largeObjects),
+        static_cast<double>(s.compactions),
+    };
+    unsigned size = sizeof(values) / sizeof(values[0]);
+    DoubleVector * result = DoubleVector::New(size);
+    memcpy(result->data, values, sizeof(values));
+    return result;
+}
+
+RVal * gcCollect() {
+    gc::GarbageCollector::collect();
+    return gcStats();
+}
+
 } // extern "C"
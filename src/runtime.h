@@ -11,9 +11,12 @@
     FUN_PURE(doubleVectorLiteral, type::v_d) \
     FUN_PURE(characterVectorLiteral, type::v_i) \
     FUN_PURE(genericGetElement, type::v_vv) \
-    FUN(genericSetElement, type::void_vvv) \
+    FUN(genericSetElement, type::v_vvv) \
     FUN(envGet, type::v_ei) \
     FUN(envSet, type::void_eiv) \
+    FUN(envSetSlot, type::void_eiv) \
+    FUN(envGetCached, type::v_eipc) \
+    FUN(envSetCached, type::void_eivpc) \
     FUN_PURE(genericAdd, type::v_vv) \
     FUN_PURE(genericSub, type::v_vv) \
     FUN_PURE(genericMul, type::v_vv) \
@@ -28,7 +31,13 @@
     FUN_PURE(length, type::d_v) \
     FUN_PURE(type, type::v_v) \
     FUN(genericEval, type::v_ev) \
-    FUN_PURE(c, type::v_iVA)
+    FUN_PURE(c, type::v_iVA) \
+    FUN(gcCollect, type::v) \
+    FUN(gcStats, type::v) \
+    FUN(gcEnterFrame, type::pv_i) \
+    FUN(gcLeaveFrame, type::void_pv) \
+    FUN(gcAllocBuffer, type::pw) \
+    FUN(gcSafepoint, type::void_)
 
 #if VERSION <= 10
 #define RUNTIME_FUNCTIONS GENERIC_RUNTIME_FUNCTIONS
@@ -68,6 +77,25 @@
 */
 extern "C" {
 
+/** Pushes a frame with given number of root slots on the GC's shadow stack.
+    Compiled functions keep their environment and all values live across a
+    call in there.
+ */
+RVal ** gcEnterFrame(int slots);
+
+/** Pops the frame and everything above it from the shadow stack. */
+void gcLeaveFrame(RVal ** frame);
+
+/** Returns the allocation buffer of the calling thread. Compiled code bump
+    allocates scalars from it and only calls the runtime once it is full.
+ */
+gc::AllocationBuffer * gcAllocBuffer();
+
+/** Stops the calling thread while another one collects. Compiled code only
+    calls it once it saw the request flag of the collector set.
+ */
+void gcSafepoint();
+
 /** Creates new environment from parent. */
 Environment * envCreate(Environment * parent);
 
@@ -77,17 +105,29 @@ RVal * envGet(Environment * env, int symbol);
 /** Binds symbol to the value in env. */
 void envSet(Environment * env, int symbol, RVal * value);
 
-/** Creates a double vector from the literal. */
+/** Like envGet, the cache belongs to the call site. */
+RVal * envGetCached(Environment * env, int symbol, EnvCache * cache);
+
+/** Like envSet, the cache belongs to the call site. */
+void envSetCached(Environment * env, int symbol, RVal * value,
+        EnvCache * cache);
+
+/** Binds the variable in the given fixed slot of env to the value. */
+void envSetSlot(Environment * env, int slot, RVal * value);
+
+/** Creates a double vector from the literal, an immediate if it fits. */
 RVal * doubleVectorLiteral(double value);
 
-/** Creates a CV from the literal at cpIndex in the constant pool */
+/** Returns the shared CV of the literal at cpIndex in the constant pool */
 RVal * characterVectorLiteral(int cpIndex);
 
 /** Returns the value at index.  */
 RVal * genericGetElement(RVal * from, RVal * index);
 
-/** Sets the value at index.  */
-void genericSetElement(RVal * target, RVal * index, RVal * value);
+/** Sets the value at index. Returns the target, or a copy of it if it was
+    shared or an immediate.
+ */
+RVal * genericSetElement(RVal * target, RVal * index, RVal * value);
 
 /** Adds doubles and concatenates strings. */
 RVal * genericAdd(RVal * lhs, RVal * rhs);
@@ -145,6 +185,16 @@ RVal * genericEval(Environment * env, RVal * value);
     if there is a function among them.
  */
 RVal * c(int size, ...);
+
+/** Statistics of the GC as a double vector: minor collections, major
+    collections, total and longest pause in seconds, old generation size
+    and limit in bytes, bytes allocated and freed since startup, arena pages,
+    large objects and compactions of the arena.
+ */
+RVal * gcStats();
+
+/** Runs a full collection and returns gcStats() afterwards. */
+RVal * gcCollect();
 }
 
 #endif // RUNTIME_H
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+
 #include "rift.h"
 
 /** The type tag associated with values. */
@@ -27,6 +31,14 @@ struct RVal {
     Type type;
     /** GC information. */
     Mark mark;
+    /** Set while the object is in the GC's remembered set. */
+    bool remembered;
+    /** Number of variables bound to the object, it saturates at SHARED.
+        Vectors are copied before they are written once they are shared.
+     */
+    uint8_t named;
+
+    static constexpr uint8_t SHARED = 2;
 
     /** Prints to given stream.  */
     inline void print(ostream & s);
@@ -38,3 +50,53 @@ struct RVal {
     RVal() = delete;
     RVal(RVal const&) = delete;
 };
+
+/**
+ * Immediate scalars.
+ *
+ * Doubles with a small integral value are not allocated, the RVal pointer
+ * encodes them as (value << 1) | 1 instead. Heap objects are word aligned,
+ * so the low bit tells the two apart. The encoded value has to fit the 32
+ * bit references of the heap, all other doubles are boxed in a DoubleVector
+ * of length one. Immediates must never be dereferenced, use typeOf().
+ */
+constexpr int64_t immediateMin = -(int64_t(1) << 30);
+constexpr int64_t immediateMax = (int64_t(1) << 30) - 1;
+
+inline bool isImmediate(void const * v) {
+    return reinterpret_cast<uintptr_t>(v) & 1;
+}
+
+/** Whether d can be stored as immediate. Negative zero is boxed.  */
+inline bool fitsImmediate(double d) {
+    return d >= immediateMin && d <= immediateMax &&
+        d == static_cast<int32_t>(d) && !(d == 0 && signbit(d));
+}
+
+inline RVal * toImmediate(double d) {
+    assert(fitsImmediate(d));
+    return reinterpret_cast<RVal*>(
+            static_cast<uintptr_t>(static_cast<intptr_t>(d)) << 1 | 1);
+}
+
+inline double immediateValue(RVal const * v) {
+    assert(isImmediate(v));
+    return static_cast<double>(reinterpret_cast<intptr_t>(v) >> 1);
+}
+
+/** Type of v, immediates are doubles.  */
+inline Type typeOf(RVal const * v) {
+    return isImmediate(v) ? Type::Double : v->type;
+}
+
+/** Called whenever v is bound to a variable.  */
+inline void markNamed(RVal * v) {
+    if (!isImmediate(v) && v->named < RVal::SHARED)
+        ++v->named;
+}
+
+/** Whether v may be seen through more than one variable. Immediates are
+    values and never shared.  */
+inline bool isShared(RVal const * v) {
+    return !isImmediate(v) && v->named >= RVal::SHARED;
+}
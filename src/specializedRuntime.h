@@ -17,10 +17,12 @@ extern "C" {
     /** Returns a subset of character vector.  */
     RVal * characterGetElement(CharacterVector * from, DoubleVector * index);
 
-    /** Sets the index-th element of given double vector.  */
+    /** Sets the index-th element of given double vector. The target must
+        not be an immediate.  */
     void doubleSetElement(DoubleVector * target, DoubleVector * index, DoubleVector * value);
 
-    /** Sets the specified subset of given double vector. */
+    /** Sets the specified subset of given double vector, which must not be
+        an immediate.  */
     void scalarSetElement(DoubleVector * target, double index, double value);
 
     /** Sets the given subset of character vector.  */
@@ -1,3 +1,5 @@
+#include <thread>
+
 #include "runtime.h"
 #include "tests.h"
 
@@ -8,13 +10,15 @@ namespace {
 
 /** Compares values for equality. Only use in tests.  */
 bool eq(RVal * a, RVal * b) {
-    if (a->type != b->type)  return false;
+    if (typeOf(a) != typeOf(b))  return false;
 
     if (auto d1 = DoubleVector::Cast(a)) {
         auto d2 = DoubleVector::Cast(b);
-        if (d1->size != d2->size) return false;
-        for (unsigned i = 0; i < d1->size; ++i)
-            if (d1->data[i] != d2->data[i]) return false;
+        unsigned size = DoubleVector::sizeOf(d1);
+        if (size != DoubleVector::sizeOf(d2)) return false;
+        for (unsigned i = 0; i < size; ++i)
+            if (DoubleVector::elementAt(d1, i) != DoubleVector::elementAt(d2, i))
+                return false;
         return true;
     } else if (auto c1 = CharacterVector::Cast(a)) {
         auto c2 = CharacterVector::Cast(b);
@@ -29,13 +33,62 @@ bool eq(RVal * a, RVal * b) {
     return false;
 }
 
+/** Keeps count scalars in a chain of environments while allocating
+    garbage, forces a full collection halfway and checks the scalars at the
+    end.  */
+bool keepScalars(unsigned count) {
+    gc::HandleScope scope;
+    gc::Handle<Environment> env(Environment::New(nullptr));
+    for (unsigned i = 0; i < count; ++i) {
+        if (i % 64 == 0)
+            env = Environment::New(env);
+        RVal * value = DoubleVector::New({static_cast<double>(i)});
+        env->set(i % 64, value);
+        for (unsigned j = 0; j < 16; ++j)
+            DoubleVector::New({static_cast<double>(j)});
+        if (i == count / 2)
+            gc::GarbageCollector::collect();
+    }
+    unsigned block = (count - 1) / 64;
+    for (Environment * e = env; e->parent != nullptr; e = e->parent) {
+        for (unsigned k = 0; k < 64 && block * 64 + k < count; ++k) {
+            auto d = DoubleVector::Cast(e->get(k));
+            if (!d || DoubleVector::elementAt(d, 0) != block * 64 + k)
+                return false;
+        }
+        --block;
+    }
+    return true;
+}
+
+/** A second thread attached with a MutatorScope allocates alongside the
+    calling one, each stops for the minor and full collections of the
+    other.  */
+bool threadsAllocate() {
+    bool other = false;
+    thread t([&other] {
+        gc::MutatorScope attach;
+        other = keepScalars(20000);
+    });
+    bool own = keepScalars(20000);
+    {
+        // the other thread may collect while this one waits for it
+        gc::BlockingRegion blocking;
+        t.join();
+    }
+    return own && other;
+}
+
 }
 
 namespace rift {
 
-    void test(int line, char const * source, RVal * expected) {
+    void test(int line, char const * source, RVal * exp) {
+        gc::HandleScope scope;
+        gc::Handle<RVal> expected(exp);
         try {
-            Environment * env = Environment::New(nullptr);
+            Globals globals;
+            Environment * env = Environment::NewGlobal(&globals);
             RVal * actual = eval(env, source);
             if (! eq(expected, actual)) {
                 cout << "Expected: " << *expected << endl;
@@ -136,14 +189,61 @@ namespace rift {
         TEST("a = 1 b = 1 if (a) { b = 2 } b", 2);
         TEST("a = 0 b = 1 if (a) { b = 2 } b", 1);
         TEST("a = 10 b = 0 while (a > 0) { b = b + 1 a = a - 1 } c(a, b)", 0, 10);
+        TEST("a = 0 i = 0 while (i < 1000) { a = c(a, i) i = i + 1 } c(length(a), a[1000])", 1001, 999);
         TEST("f = function() { 1 } f()", 1);
         TEST("f = function(a, b) { a + b } f(1, 2)", 3);
         TEST("f = function() { a + b } a = 1 b = 2 f()", 3);
         TEST("f = function() { a = 1 a } a = 2 c(f(), a)", 1, 2);
 
+        // the closure environment has to survive many minor collections
+        TEST("f = function(x) { function() { x } } g = f(42) i = 0 while (i < 20000) { h = f(i) i = i + 1 } g()", 42);
+        // a long chain of closure environments stays live while marked
+        TEST("f = function(g) { function() { g() + 1 } } g = function() { 0 } i = 0 while (i < 1000) { g = f(g) i = i + 1 } g()", 1000);
+        TEST("length(gcstats())", 11);
+        TEST("s = gc() s[1] > 0", 1);
+        if (! threadsAllocate())
+            cout << "ERROR at line " << __LINE__ << " : two threads" << endl;
+        cout << "." << flush;
+        // links of two chains share the arena pages, dropping one leaves
+        // every page half empty and the next gc compacts
+        TEST("f = function(g) { function() { g() + 1 } } g = function() { 0 } h = g i = 0 while (i < 1000) { g = f(g) h = f(h) s = gc() i = i + 1 } s = gcstats() h = 0 t = gc() c(g(), t[10] > s[10])", 1000, 1);
+
         TEST("a = c(1, 2, 3) a[1]", 2);
         TESTC("a = \"aba\" a[c(0,2)]", "aa");
         TEST("a = c(1,2,3) a[c(0,1)] = 56 a", 56, 56, 3);
+        // small integral scalars are immediates, others are boxed
+        TEST("a = 1 a[0] = 2.5 a", 2.5);
+        TEST("a = 1073741823 b = a + 1 c(b - a, b / 2)", 1, 536870912);
+        // writes to shared vectors do not show through other variables
+        TEST("a = c(1, 2) b = a a[0] = 5 c(a, b)", 5, 2, 1, 2);
+        TEST("a = c(1, 2) f = function(x) { x[0] = 5 x } c(f(a), a)", 5, 2, 1, 2);
+        TEST("a = c(1, 2) f = function() { a[0] = 5 a } c(f(), a)", 5, 2, 1, 2);
+        // the literal of the constant pool is not changed by the assignment
+        TESTC("f = function() { a = \"aba\" b = a[0] a[0] = \"c\" b } f() f()", "a");
+        // variables in slots, outer ones until the function assigns them
+        TEST("a = 1 f = function() { b = a a = 2 c(b, a) } c(f(), a)", 1, 2, 1);
+        TEST("f = function(x) { y = x + 1 function(z) { x + y + z } } h = f(1) h(10)", 13);
+        TEST("f = function() { eval(\"a = 3\") g = function() { a } g() } a = 1 c(f(), a)", 3, 1);
+        // inline caches of lookups by name notice bindings created since
+        TEST("f = function() { a } a = 1 x = f() a = 2 c(x, f())", 1, 2);
+        TEST("f = function(s) { eval(s) g = function() { a } g() } a = 1 c(f(\"b = 1\"), f(\"a = 2\"), f(\"b = 1\"))", 1, 2, 1);
+        // frames below the watermark are not rescanned by minor gcs, their
+        // slots have to be right once the calls return
+        TEST("f = function(n) { a = c(n, 1) i = 0 while (i < 20) { x = c(i, i) i = i + 1 } if (n == 0) { a } else { b = f(n - 1) x = c(b[0] + a[0], b[1] + a[1]) i = 0 while (i < 20) { y = c(i) i = i + 1 } x } } f(2000)", 2001000, 2001);
+        // globals live in cells of a hash table
+        TEST("x = 1 f = function() { x } y = f() eval(\"x = 4\") c(y, x, f())", 1, 4, 4);
+
+        // again while scanning the C stack, which pins what it finds in the
+        // nursery and in the arena
+        bool conservative = gc::GarbageCollector::isConservative();
+        gc::GarbageCollector::setConservative(true);
+        TEST("a = 0 i = 0 while (i < 1000) { a = c(a, i) i = i + 1 } c(length(a), a[1000])", 1001, 999);
+        TEST("f = function(x) { function() { x } } g = f(42) i = 0 while (i < 20000) { h = f(i) i = i + 1 } g()", 42);
+        TEST("f = function(g) { function() { g() + 1 } } g = function() { 0 } i = 0 while (i < 1000) { g = f(g) i = i + 1 } g()", 1000);
+        TEST("f = function(x) { y = x + 1 function(z) { x + y + z } } h = f(1) s = gc() h(10)", 13);
+        TEST("a = c(1, 2) b = a s = gc() a[0] = 5 c(a, b)", 5, 2, 1, 2);
+        TEST("f = function(g) { function() { g() + 1 } } g = function() { 0 } h = g i = 0 while (i < 1000) { g = f(g) h = f(h) s = gc() i = i + 1 } h = 0 s = gc() g()", 1000);
+        gc::GarbageCollector::setConservative(conservative);
 
 #if VERSION < 5
         // TODO implement if
@@ -60,7 +60,8 @@ void TypeAnalysis::analyzeCallInst(CallInst* ci, StringRef s) {
     } else if (s == "genericGetElement") {
         genericGetElement(ci);
     } else if (s == "genericSetElement") {
-        // don't do anything for set as it does not produce any new value
+        // the target is returned, it keeps its type even if it was boxed
+        state.update(ci, state.get(ci->getOperand(0)));
     } else if (s=="genericAdd" || s=="genericSub" || s=="genericMul" || s=="genericDiv") {
         genericArithmetic(ci);
     } else if (s=="genericEq" || s=="genericNeq" || s=="genericLt" || s=="genericGt") {
@@ -84,6 +85,8 @@ void TypeAnalysis::analyzeCallInst(CallInst* ci, StringRef s) {
         if (t1->isDoubleScalar())// concatenation of scalars is a vector
             t1 = AType::DV;
         state.update(ci, t1);
+    } else if (s == "gcStats" || s == "gcCollect") {
+        state.update(ci, AType::DV);
     } else if (s == "genericEval" || s == "envGet") {
         state.update(ci, AType::T);
     } else {
@@ -105,6 +108,12 @@ bool TypeAnalysis::runOnFunction(llvm::Function & f) {
                     AType * l = state.get(phi->getOperand(0));
                     AType * r = state.get(phi->getOperand(1));
                     state.update(phi, l->lub(r));
+                } else if (StoreInst * si = dyn_cast<StoreInst>(&i)) {
+                    // values kept in shadow stack slots keep their type
+                    state.update(si->getPointerOperand(),
+                            state.get(si->getValueOperand()));
+                } else if (LoadInst * li = dyn_cast<LoadInst>(&i)) {
+                    state.update(li, state.get(li->getPointerOperand()));
                 } else {
                     // ignore control flow operations
                 }
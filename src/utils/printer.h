@@ -100,6 +100,14 @@ public:
         s << "length";
         printArgs(n);
     }
+    void visit(GcCall * n) override {
+        s << "gc";
+        printArgs(n);
+    }
+    void visit(GcStatsCall * n) override {
+        s << "gcstats";
+        printArgs(n);
+    }
     void visit(Index * n) override {
         n->name->accept(this);
         s << "[";